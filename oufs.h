@@ -18,15 +18,29 @@
 
 // Implementation of min operator
 #define MIN(a, b) (((a) > (b)) ? (b) : (a))
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
 
 /**********************************************************************/
 /*
 File system layout onto disk blocks:
 
-Block 0: Master block
-Blocks 1 ... N_INODE_BLOCKS: inodes
-Blocks N_INODE_BLOCKS+1 ... N_BLOCKS_ON_DISK-1: data for files and directories
-   (Block N_BLOCKS+1 is allocated for the root directory)
+Block 0: Master block (allocation tables, superblock at SUPERBLOCK_OFFSET)
+Blocks 1 ... : allocation tables that do not fit in block 0 (large disks only)
+Next N_INODE_BLOCKS blocks: inodes, starting at INODE_TABLE_BLOCK
+Remaining blocks up to N_BLOCKS_IN_DISK-1: data for files and directories
+   (ROOT_DIRECTORY_BLOCK, the first of them, holds the root directory)
+
+The geometry comes from the superblock (see OUFS_GEOMETRY).  A disk with
+the default geometry has the original layout: tables in block 0, inodes in
+blocks 1 ... 8 and the root directory in block 9.
+
+Inodes and directory entries come in two on-disk formats.  The original
+(narrow) one stores 16-bit block and inode references, which limits a disk
+to 65535 blocks.  Disks with SUPERBLOCK_FEATURE_WIDE_REFS store 32-bit
+references: inodes and directory entries are then laid out exactly as the
+in-memory INODE and DIRECTORY_ENTRY.  Code outside oufs_lib_support.c only
+sees the in-memory forms (see oufs_read_inode_by_reference() and
+oufs_read_directory_block()).
 */
 
 /**********************************************************************/
@@ -34,31 +48,68 @@ Blocks N_INODE_BLOCKS+1 ... N_BLOCKS_ON_DISK-1: data for files and directories
 // Chosen carefully so that all block types pack nicely into a full block
 
 // An index that refers to an inode
-typedef unsigned short INODE_REFERENCE;
+typedef unsigned int INODE_REFERENCE;
 // Value used as an index when it does not refer to an inode
-#define UNALLOCATED_INODE (USHRT_MAX-1)
+#define UNALLOCATED_INODE (UINT_MAX-1)
 
 // Value used as an index when it does not refer to a block
-#define UNALLOCATED_BLOCK USHRT_MAX
+#define UNALLOCATED_BLOCK UINT_MAX
 
-// Number of inode blocks on the virtual disk
-#define N_INODE_BLOCKS 8
+// The same values as stored by the narrow on-disk format
+#define NARROW_UNALLOCATED_INODE (USHRT_MAX-1)
+#define NARROW_UNALLOCATED_BLOCK USHRT_MAX
 
-// The block on the virtual disk containing the root directory
-#define ROOT_DIRECTORY_BLOCK (N_INODE_BLOCKS + 1)
+// Superblock feature: 32-bit references on disk
+#define SUPERBLOCK_FEATURE_WIDE_REFS 0x1
+
+// Superblock feature: the last two block references of a file's inode
+// point to a single and a double indirect block
+#define SUPERBLOCK_FEATURE_INDIRECT 0x2
+
+// Superblock feature: files are mapped by extents (runs of consecutive
+// blocks) rather than block by block.  Replaces SUPERBLOCK_FEATURE_INDIRECT
+#define SUPERBLOCK_FEATURE_EXTENTS 0x4
+
+// Superblock feature: large directories are indexed by a hash of the name
+// (OUFS_DX_NODE)
+#define SUPERBLOCK_FEATURE_DIR_INDEX 0x8
+
+// Number of inode blocks on a disk formatted without a superblock, and the
+// zformat default
+#define DEFAULT_N_INODE_BLOCKS 8
 
 // Size of file/directory name
-#define FILE_NAME_SIZE (16 - sizeof(INODE_REFERENCE))
+#define FILE_NAME_SIZE (16 - sizeof(unsigned short))
 
 // Number of data block references in an inode.  Just big enough to fit a reasonable
 //  number of inodes into a single block
 #define BLOCKS_PER_INODE (16-1)
 
+// With SUPERBLOCK_FEATURE_INDIRECT: the first N_DIRECT_BLOCKS references
+// of a file are direct, then come the indirect blocks.  An indirect block
+// is an array of REFERENCES_PER_BLOCK block references (16 or 32 bits, as
+// in inodes).  Directories only use direct blocks.
+#define N_DIRECT_BLOCKS (BLOCKS_PER_INODE-2)
+#define SINGLE_INDIRECT_SLOT (BLOCKS_PER_INODE-2)
+#define DOUBLE_INDIRECT_SLOT (BLOCKS_PER_INODE-1)
+#define REFERENCES_PER_BLOCK (oufs_geometry()->references_per_block)
+
+// With SUPERBLOCK_FEATURE_EXTENTS: a file's inode holds N_INODE_EXTENTS
+// extents as (start, length) pairs of references, in file order and ended
+// by a zero or unallocated length.  The reference in EXTENT_OVERFLOW_SLOT
+// starts a chain of extent blocks holding the rest; each holds the next
+// block of the chain followed by (start, length) pairs.
+#define N_INODE_EXTENTS ((BLOCKS_PER_INODE-1)/2)
+#define EXTENT_OVERFLOW_SLOT (BLOCKS_PER_INODE-1)
+
+// Longest extent (fits a narrow reference)
+#define MAX_EXTENT_BLOCKS 32768
+
 /**********************************************************************/
 // Data block: storage for file contents (project 4!)
 typedef struct data_block_s
 {
-  unsigned char data[BLOCK_SIZE];
+  unsigned char data[MAX_BLOCK_SIZE];
 } DATA_BLOCK;
 
 
@@ -68,7 +119,7 @@ typedef struct data_block_s
 #define IT_DIRECTORY 'D'
 #define IT_FILE 'F'
 
-// Single inode
+// Single inode (also the wide on-disk format)
 typedef struct inode_s
 {
   // IT_NONE, IT_DIRECTORY, IT_FILE
@@ -77,6 +128,8 @@ typedef struct inode_s
   // Number of directories references to this inode
   unsigned char n_references;
 
+  unsigned short reserved;
+
   // Contents.  UNALLOCATED_BLOCK means that this entry is not used
   BLOCK_REFERENCE data[BLOCKS_PER_INODE];
 
@@ -84,76 +137,299 @@ typedef struct inode_s
   unsigned int size;
 } INODE;
 
-// Number of inodes stored in each block
-#define INODES_PER_BLOCK (BLOCK_SIZE/sizeof(INODE))
-
-// Total number of inodes in the file system
-#define N_INODES (INODES_PER_BLOCK * N_INODE_BLOCKS)
-
-// Block of inodes
-typedef struct inode_block_s
+// Inode in the narrow on-disk format
+typedef struct narrow_inode_s
 {
-  INODE inode[INODES_PER_BLOCK];
-} INODE_BLOCK;
+  char type;
+  unsigned char n_references;
+  unsigned short data[BLOCKS_PER_INODE];
+  unsigned int size;
+} NARROW_INODE;
+
+// Number of inodes stored in each block
+#define INODES_PER_BLOCK (oufs_geometry()->inodes_per_block)
 
 
 /**********************************************************************/
 // Block 0
 #define MASTER_BLOCK_REFERENCE 0
 
-typedef struct master_block_s
+// The allocation tables are bitmaps:
+//  8 inodes per byte: One inode per bit: 1 = allocated, 0 = free
+//  The first inode is byte 0, bit 0
+//  8 data blocks per byte: One block per bit: 1 = allocated, 0 = free
+//  Block 0 (the master block) is byte 0, bit 0
+// The inode table comes first.  If both tables fit ahead of the superblock
+// they are in block 0, back to back; otherwise they start at block 1.
+
+// Where things are on the mounted disk, derived from its superblock
+typedef struct oufs_geometry_s
 {
-  // 8 inodes per byte: One inode per bit: 1 = allocated, 0 = free
-  // The first inode is byte 0, bit 0
-  unsigned char inode_allocated_flag[N_INODES >> 3];
+  int n_inode_blocks;
+  int n_inodes;
+
+  // Blocks 0 ... n_map_blocks-1 hold the allocation tables.  Offsets are
+  // in bytes from the start of block 0
+  int n_map_blocks;
+  int inode_map_offset;
+  int block_map_offset;
+
+  // First block of inodes
+  BLOCK_REFERENCE inode_table_block;
+
+  // Superblock features
+  unsigned int features;
+
+  // On-disk sizes, which depend on the reference width
+  int inode_size;
+  int inodes_per_block;
+  int directory_entry_size;
+  int directory_entries_per_block;
+  int references_per_block;
+} OUFS_GEOMETRY;
 
-  // 8 data blocks per byte: One block per bit: 1 = allocated, 0 = free
-  // Block 0 (the master block) is byte 0, bit 0
-  unsigned char block_allocated_flag[N_BLOCKS_IN_DISK >> 3];
-} MASTER_BLOCK;
+// Geometry of the open disk (read from the disk on first use)
+const OUFS_GEOMETRY *oufs_geometry();
+
+// Number of inode blocks on the virtual disk
+#define N_INODE_BLOCKS (oufs_geometry()->n_inode_blocks)
+
+// Total number of inodes in the file system
+#define N_INODES (oufs_geometry()->n_inodes)
+
+// The first block of inodes
+#define INODE_TABLE_BLOCK (oufs_geometry()->inode_table_block)
+
+// The block on the virtual disk containing the root directory
+#define ROOT_DIRECTORY_BLOCK (INODE_TABLE_BLOCK + N_INODE_BLOCKS)
 
 /**********************************************************************/
-// Single directory element
+// Single directory element (also the wide on-disk format)
 typedef struct directory_entry_s
 {
   // Name of file/directory
   char name[FILE_NAME_SIZE];
 
+  unsigned short reserved;
+
   // UNALLOCATED_INODE if this directory entry is non-existent
   INODE_REFERENCE inode_reference;
 
 } DIRECTORY_ENTRY;
 
+// Directory entry in the narrow on-disk format
+typedef struct narrow_directory_entry_s
+{
+  char name[FILE_NAME_SIZE];
+  unsigned short inode_reference;
+} NARROW_DIRECTORY_ENTRY;
+
 // Number of directory entries stored in one data block
-#define DIRECTORY_ENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(DIRECTORY_ENTRY))
+#define DIRECTORY_ENTRIES_PER_BLOCK (oufs_geometry()->directory_entries_per_block)
 
-// Directory block
+// Directory block, as held in memory (oufs_read_directory_block())
 typedef struct directory_block_s
 {
-  DIRECTORY_ENTRY entry[DIRECTORY_ENTRIES_PER_BLOCK];
+  DIRECTORY_ENTRY entry[MAX_BLOCK_SIZE / sizeof(NARROW_DIRECTORY_ENTRY)];
 } DIRECTORY_BLOCK;
 
+// Indexed directories (SUPERBLOCK_FEATURE_DIR_INDEX): a B+tree keyed by a
+// hash of the name.  Block 0 of the directory holds "." and "..", then an
+// entry named DIRECTORY_INDEX_NAME (a name no path can produce) whose inode
+// reference is the directory block holding the root index node.  Index
+// nodes lead to leaves, which are ordinary directory blocks holding the
+// entries whose hashes fall in their range.  Block numbers in the tree are
+// blocks of the directory, not of the disk
+#define DIRECTORY_INDEX_NAME "/index"
+
+// A linear directory is indexed when it needs more blocks than this
+#define DIRECTORY_INDEX_THRESHOLD 2
+
+// Most levels of index nodes
+#define DX_MAX_DEPTH 4
+
+// Index node entry: child covers the hashes from hash up to the next
+// entry's hash (the first entry of a node covers everything below)
+typedef struct oufs_dx_entry_s
+{
+  unsigned int hash;
+  unsigned int block;
+} OUFS_DX_ENTRY;
+
+// Index node: children are leaves at level 0, index nodes above
+typedef struct oufs_dx_node_s
+{
+  unsigned int level;
+  unsigned int count;
+  OUFS_DX_ENTRY entry[(MAX_BLOCK_SIZE - 8) / sizeof(OUFS_DX_ENTRY)];
+} OUFS_DX_NODE;
+
+// Number of entries in one index node
+#define DX_ENTRIES_PER_NODE ((BLOCK_SIZE - 8) / (int) sizeof(OUFS_DX_ENTRY))
+
 /**********************************************************************/
 // All-encompassing structure for a disk block
-// The union says that all 4 of these elements occupy overlapping bytes in
-//  memory (hence, a block will only be one of these 4 at any given time)
+// The union says that both of these elements occupy overlapping bytes in
+//  memory (hence, a block will only be one of these at any given time).
+// Only the first BLOCK_SIZE bytes of data are used; directory holds a
+// decoded directory block
 typedef union block_u
 {
   DATA_BLOCK data;
-  MASTER_BLOCK master;
-  INODE_BLOCK inodes;
   DIRECTORY_BLOCK directory;
 } BLOCK;
 
 
+/**********************************************************************/
+// Indirect block, as held in memory
+typedef struct oufs_indirect_s
+{
+  // Block the references came from (UNALLOCATED_BLOCK: none)
+  BLOCK_REFERENCE block_ref;
+
+  // 1 if ref[] has changed since it was read
+  int dirty;
+
+  BLOCK_REFERENCE ref[MAX_BLOCK_SIZE / sizeof(unsigned short)];
+} OUFS_INDIRECT;
+
+// Run of length consecutive file blocks stored in consecutive disk blocks
+// from start (UNALLOCATED_BLOCK: a hole, the blocks are not stored)
+typedef struct oufs_extent_s
+{
+  BLOCK_REFERENCE start;
+  unsigned int length;
+} OUFS_EXTENT;
+
+// State of a walk over the block map of an inode (oufs_bmap()).  Holds on
+// to the indirect blocks in use so that consecutive lookups share them
+typedef struct oufs_bmap_s
+{
+  INODE *inode;
+
+  // 1 if the inode has changed
+  int inode_dirty;
+
+  // Double indirect block, and the single indirect block in use
+  OUFS_INDIRECT top;
+  OUFS_INDIRECT leaf;
+
+  // Extent-mapped files: the whole extent list (loaded on first use) and
+  // the chain of extent blocks it came from
+  int extents_loaded;
+  int extents_dirty;
+  OUFS_EXTENT *extents;
+  int n_extents;
+  int max_extents;
+  BLOCK_REFERENCE *chain;
+  int n_chain;
+
+  // Lookup cursor: an extent and the first file block it covers
+  int cursor;
+  unsigned int cursor_index;
+} OUFS_BMAP;
+
+// Number of directories with a free-slot hint
+#define N_DIRECTORY_HINTS 64
+
+// Free-slot hint: directory blocks before block are all full
+typedef struct oufs_directory_hint_s
+{
+  INODE_REFERENCE dir;
+  int block;
+} OUFS_DIRECTORY_HINT;
+
+// Scan kernel: scan finds the directory entry whose first length + 1
+// bytes match key (a name padded with zeros to 16 bytes), or returns -1;
+// is_zero checks that a block (a multiple of 256 bytes) is all zeros
+typedef struct oufs_scan_kernel_s
+{
+  const char *name;
+  // NULL if every processor supports the kernel
+  int (*supported)(void);
+  int (*scan)(const DIRECTORY_ENTRY *entries, int n, const char *key, int length);
+  int (*is_zero)(const unsigned char *data, int length);
+} OUFS_SCAN_KERNEL;
+
+// Walk over the components of a path (oufs_path_next())
+typedef struct oufs_path_iter_s
+{
+  const char *next;
+} OUFS_PATH_ITER;
+
+// Number of slots in the dentry cache (a power of two)
+#define N_DENTRY_CACHE 1024
+
+// Dentry cache slot: name in directory parent is inode child.  A child of
+// UNALLOCATED_INODE records that there is no such name
+typedef struct oufs_dentry_s
+{
+  INODE_REFERENCE parent;  // UNALLOCATED_INODE: empty slot
+  INODE_REFERENCE child;
+  char name[FILE_NAME_SIZE];
+} OUFS_DENTRY;
+
+// oufs_opendir() flags: return the entries in ASCII order; leave
+// fetching the entries' inodes to the caller
+#define OUFS_READDIR_SORTED 0x1
+#define OUFS_READDIR_NO_PREFETCH 0x2
+
+// oufs_list_flags() flags: long listing; list the directories below too
+#define OUFS_LIST_LONG 0x1
+#define OUFS_LIST_RECURSIVE 0x2
+
+// Directory open for reading (oufs_opendir()): its entries, read at once
+typedef struct oufs_dir_s
+{
+  INODE_REFERENCE inode_reference;
+  DIRECTORY_ENTRY *entries;
+  int n_entries;
+  int next;
+} OUFS_DIR;
+
+// Directory entry as returned by oufs_readdir()
+typedef struct oufs_dirent_s
+{
+  char name[FILE_NAME_SIZE];
+  INODE_REFERENCE inode_reference;
+  // IT_DIRECTORY or IT_FILE
+  char type;
+} OUFS_DIRENT;
+
 /**********************************************************************/
 // Representing files (project 4!)
 
+// Open file.  The handle keeps the file's inode while it is open and
+// one block of the file, so that small reads and writes don't each go to
+// the disk; both are written back by oufs_fflush() and oufs_fclose()
 typedef struct oufile_s
 {
   INODE_REFERENCE inode_reference;
   char mode;
+  // Advanced by oufs_fread() and oufs_fwrite()
   int offset;
+
+  INODE inode;
+  int inode_dirty;
+
+  // File block held in buffer (-1 if none), the disk block it came from,
+  // and whether buffer has changed since
+  int buffer_block;
+  BLOCK_REFERENCE buffer_ref;
+  int buffer_dirty;
+  BLOCK buffer;
+
+  // 1 to leave whole blocks of zeros written over holes as holes (ZSPARSE)
+  int sparse;
+
+  // Readahead (reading): ra_window holds ra_count blocks from file block
+  // ra_start.  The next fill reads ra_size blocks (0 while access is not
+  // sequential); a read starting at ra_next is sequential
+  unsigned char *ra_window;
+  int ra_start;
+  int ra_count;
+  int ra_size;
+  int ra_next;
 } OUFILE;
 
 
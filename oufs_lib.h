@@ -1,19 +1,38 @@
 #ifndef OUFS_LIB
 #define OUFS_LIB
+#include <sys/uio.h>
 #include "oufs.h"
 
 #define MAX_PATH_LENGTH 200
 
+// Number of blocks moved by one vectored transfer in oufs_fread/oufs_fwrite
+#define OUFS_IO_BATCH 16
+
+// Readahead window of a sequential reader: starts at OUFS_RA_MIN blocks and
+// doubles with each fill, up to OUFS_RA_MAX
+#define OUFS_RA_MIN 4
+#define OUFS_RA_MAX 32
+
 // PROVIDED
 void oufs_get_environment(char *cwd, char *disk_name);
 
 // PROJECT 3
 int oufs_format_disk(char  *virtual_disk_name);
+int oufs_format_disk_geometry(char *virtual_disk_name, int block_size, int n_blocks, int n_inodes, unsigned int features);
 int oufs_read_inode_by_reference(INODE_REFERENCE i, INODE *inode);
 int oufs_write_inode_by_reference(INODE_REFERENCE i, INODE *inode);
-int oufs_find_file(char *cwd, char * path, INODE_REFERENCE *parent, INODE_REFERENCE *child, char *local_name); //TODO
+void oufs_decode_inode(const unsigned char *raw, INODE *inode);
+void oufs_encode_inode(const INODE *inode, unsigned char *raw);
+int oufs_read_directory_block(BLOCK_REFERENCE block_ref, BLOCK *block);
+int oufs_write_directory_block(BLOCK_REFERENCE block_ref, BLOCK *block);
+int oufs_find_file(const char *cwd, const char *path, INODE_REFERENCE *parent, INODE_REFERENCE *child, char *local_name);
 int oufs_mkdir(char *cwd, char *path);
 int oufs_list(char *cwd, char *path);
+int oufs_list_flags(char *cwd, char *path, int flags);
+OUFS_DIR *oufs_opendir(char *cwd, char *path, int flags);
+OUFS_DIR *oufs_opendir_inode(INODE_REFERENCE dir, int flags);
+int oufs_readdir(OUFS_DIR *dir, OUFS_DIRENT *dirent);
+void oufs_closedir(OUFS_DIR *dir);
 int oufs_rmdir(char *cwd, char *path);
 int oufs_dir_entry_cmp(const void *entry_ref_1, const void *entry_ref_2);
 
@@ -23,18 +42,50 @@ void oufs_clean_directory_entry(DIRECTORY_ENTRY *entry);
 void oufs_clean_block(BLOCK *block);
 void oufs_clean_inode(INODE *inode);
 BLOCK_REFERENCE oufs_allocate_new_block();
+BLOCK_REFERENCE oufs_allocate_new_blocks(int n_blocks);
+BLOCK_REFERENCE oufs_allocate_new_blocks_near(int n_blocks, BLOCK_REFERENCE goal);
 void oufs_deallocate_old_block(BLOCK_REFERENCE old_block_reference);
 INODE_REFERENCE oufs_allocate_new_inode();
 void oufs_deallocate_old_inode(INODE_REFERENCE old_inode_reference);
 int oufs_find_open_bit(unsigned char value);
-INODE_REFERENCE oufs_find_entry(INODE *inode, char * entry_name);
+int oufs_bitmap_find_clear(const unsigned char *bitmap, int n_bits, int hint);
+int oufs_bitmap_find_clear_run(const unsigned char *bitmap, int n_bits, int n_run, int hint);
+int oufs_flush();
+void oufs_bmap_begin(OUFS_BMAP *map, INODE *inode);
+int oufs_bmap(OUFS_BMAP *map, int first, int n_blocks, BLOCK_REFERENCE *block_refs, int allocate);
+int oufs_bmap_end(OUFS_BMAP *map);
+void oufs_bmap_truncate(INODE *inode, int n_blocks);
+int oufs_bmap_extents(OUFS_BMAP *map, const OUFS_EXTENT **extents);
+unsigned char *oufs_allocation_table(int inodes);
+int oufs_prefetch_inodes(const INODE_REFERENCE *refs, int n);
+int oufs_inode_n_blocks(INODE *inode);
+INODE_REFERENCE oufs_find_entry(INODE *inode, const char *entry_name, int length);
+void oufs_path_begin(OUFS_PATH_ITER *it, const char *path);
+int oufs_path_next(OUFS_PATH_ITER *it, const char **name, int *length);
+void oufs_dcache_invalidate(INODE_REFERENCE parent, const char *name);
+int oufs_directory_add(INODE_REFERENCE dir, const char *name, INODE_REFERENCE child);
+INODE_REFERENCE oufs_directory_remove(INODE_REFERENCE dir, const char *name);
+int oufs_directory_entries(INODE *inode, DIRECTORY_ENTRY **entries);
+int oufs_directory_scan(const DIRECTORY_ENTRY *entries, int n, const char *name, int length);
+int oufs_select_scan_kernel(const char *name);
+const OUFS_SCAN_KERNEL *oufs_scan_kernel(void);
+int oufs_block_is_zero(const unsigned char *data, int length);
+int oufs_cwd_cookie(const char *cwd, char *cookie, int size);
 
 
 // PROJECT 4 ONLY
 OUFILE* oufs_fopen(char *cwd, char *path, char *mode);
 void oufs_fclose(OUFILE *fp);
+int oufs_fflush(OUFILE *fp);
 int oufs_fwrite(OUFILE *fp, unsigned char * buf, int len);
 int oufs_fread(OUFILE *fp, unsigned char * buf, int len);
+int oufs_pread(OUFILE *fp, unsigned char *buf, int len, int offset);
+int oufs_pwrite(OUFILE *fp, unsigned char *buf, int len, int offset);
+int oufs_preadv(OUFILE *fp, const struct iovec *iov, int iovcnt, int offset);
+int oufs_pwritev(OUFILE *fp, const struct iovec *iov, int iovcnt, int offset);
+int oufs_fseek(OUFILE *fp, long offset, int whence);
+long oufs_ftell(OUFILE *fp);
+int oufs_readahead_window(OUFILE *fp, int *first_block, int *n_blocks);
 int oufs_remove(char *cwd, char *path);
 int oufs_touch(char *cwd, char *path);
 int oufs_create(char *cwd, char *path);
@@ -1,8 +1,55 @@
 #include <stdlib.h>
+#include <time.h>
+#include <sys/stat.h>
 #include "oufs_lib.h"
 
+// Vector directory scan and zero check kernels, chosen at run time
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define OUFS_HAVE_X86_SCAN
+#endif
+
 #define debug 0
 
+// Resident copy of the allocation map: block 0 and any blocks of
+// allocation tables after it.  It is loaded, along with the geometry, on
+// first use and kept for as long as the disk is open; allocation bits are
+// flipped in memory and changed blocks are written back by oufs_flush(),
+// which runs when the disk is flushed or closed.
+static OUFS_GEOMETRY geometry;
+static unsigned char *allocation_map = NULL;
+static unsigned char *map_dirty = NULL;
+static int master_loaded = 0;
+static int master_dirty = 0;
+
+// Resident inode table: decoded inodes, an inode block at a time.  Blocks
+// are read on first use; updated inodes stay in memory and each changed
+// inode block is written back once, by oufs_flush()
+static INODE **inode_cache = NULL;
+static unsigned char *inode_cache_dirty = NULL;
+static int inodes_dirty = 0;
+
+// Dentry cache: recent (directory, name) lookups, hashed into a fixed
+// number of slots.  Dropped along with the rest of the resident state
+static OUFS_DENTRY *dentry_cache = NULL;
+
+// Working directory as resolved by this process
+static char cwd_cache_path[MAX_PATH_LENGTH];
+static char cwd_cache_name[FILE_NAME_SIZE];
+static INODE_REFERENCE cwd_cache_parent;
+static INODE_REFERENCE cwd_cache_child;
+static int cwd_cache_valid = 0;
+
+// Free-slot hints for recently changed directories
+static OUFS_DIRECTORY_HINT directory_hints[N_DIRECTORY_HINTS];
+
+// Directory scan kernel in use (picked on first use)
+static const OUFS_SCAN_KERNEL *scan_kernel = NULL;
+
+// Next-fit cursors: where the next scan of each allocation table starts
+static int block_allocation_hint = 0;
+static int inode_allocation_hint = 0;
+
 /**
  * Read the ZPWD and ZDISK environment variables & copy their values into cwd and disk_name.
  * If these environment variables are not set, then reasonable defaults are given.
@@ -41,7 +88,8 @@ void oufs_get_environment(char *cwd, char *disk_name)
  */
 void oufs_clean_directory_entry(DIRECTORY_ENTRY *entry)
 {
-	entry->name[0] = 0;  // No name
+	memset(entry->name, 0, FILE_NAME_SIZE);  // No name
+	entry->reserved = 0;
 	entry->inode_reference = UNALLOCATED_INODE;
 }
 
@@ -55,6 +103,7 @@ void oufs_clean_inode(INODE *inode)
 	//Initialize and empty inode
 	inode->type = IT_NONE;  // No name
 	inode->n_references = 0;
+	inode->reserved = 0;
 	inode->size = 0;
 	int i;
 	for (i = 0; i < BLOCKS_PER_INODE; i++)
@@ -113,6 +162,455 @@ void oufs_clean_block(BLOCK *block)
 	}
 }
 
+/**
+ * Drop the resident allocation map and geometry (changes are lost)
+ */
+static void oufs_unload_master()
+{
+	if (inode_cache != NULL) {
+		for (int i = 0; i < geometry.n_inode_blocks; i++)
+			free(inode_cache[i]);
+	}
+	free(inode_cache);
+	free(inode_cache_dirty);
+	inode_cache = NULL;
+	inode_cache_dirty = NULL;
+	inodes_dirty = 0;
+
+	free(dentry_cache);
+	dentry_cache = NULL;
+	cwd_cache_valid = 0;
+	memset(directory_hints, 0, sizeof(directory_hints));
+
+	free(allocation_map);
+	free(map_dirty);
+	allocation_map = NULL;
+	map_dirty = NULL;
+	master_loaded = 0;
+	master_dirty = 0;
+	block_allocation_hint = inode_allocation_hint = 0;
+}
+
+/**
+ * Called by the virtual disk before it is flushed or closed
+ *
+ * @param closing 1 if the disk is being closed
+ */
+static void oufs_flush_hook(int closing)
+{
+	oufs_flush();
+	if (closing)
+		oufs_unload_master(); //Resident state belongs to this disk only
+}
+
+/**
+ * Size of an inode on disk
+ *
+ * @param features Superblock features
+ * @return Size in bytes
+ */
+static int oufs_inode_size(unsigned int features)
+{
+	return (features & SUPERBLOCK_FEATURE_WIDE_REFS) ? sizeof(INODE) : sizeof(NARROW_INODE);
+}
+
+/**
+ * Work out where everything goes on a disk of the current block size
+ *
+ * @param n_blocks Number of blocks on the disk
+ * @param n_inode_blocks Number of inode blocks
+ * @param features Superblock features
+ * @param g Filled in with the geometry
+ * @return 0 if successful, -1 if the file system does not fit on the disk
+ */
+static int oufs_compute_geometry(int n_blocks, int n_inode_blocks, unsigned int features, OUFS_GEOMETRY *g)
+{
+	int wide = (features & SUPERBLOCK_FEATURE_WIDE_REFS) != 0;
+
+	if (n_inode_blocks < 1 || n_inode_blocks >= n_blocks)
+		return -1;
+
+	//Narrow references can't reach past 16 bits
+	if (!wide && n_blocks > NARROW_UNALLOCATED_BLOCK)
+		return -1;
+
+	g->features = features;
+	g->inode_size = oufs_inode_size(features);
+	g->inodes_per_block = BLOCK_SIZE / g->inode_size;
+	g->directory_entry_size = wide ? sizeof(DIRECTORY_ENTRY) : sizeof(NARROW_DIRECTORY_ENTRY);
+	g->directory_entries_per_block = BLOCK_SIZE / g->directory_entry_size;
+	g->references_per_block = BLOCK_SIZE / (wide ? sizeof(BLOCK_REFERENCE) : sizeof(unsigned short));
+
+	g->n_inode_blocks = n_inode_blocks;
+	g->n_inodes = n_inode_blocks * g->inodes_per_block;
+
+	int inode_map_bytes = (g->n_inodes + 7) >> 3;
+	int block_map_bytes = (n_blocks + 7) >> 3;
+
+	if (inode_map_bytes + block_map_bytes <= SUPERBLOCK_OFFSET) {
+		//Original layout: both tables in block 0
+		g->n_map_blocks = 1;
+		g->inode_map_offset = 0;
+	}
+	else {
+		//Tables get blocks of their own
+		g->n_map_blocks = 1 + ((inode_map_bytes + block_map_bytes + BLOCK_MASK) >> BLOCK_SHIFT);
+		g->inode_map_offset = BLOCK_SIZE;
+	}
+	g->block_map_offset = g->inode_map_offset + inode_map_bytes;
+	g->inode_table_block = g->n_map_blocks;
+
+	//Inode references must stay clear of UNALLOCATED_INODE, and there has
+	//to be room for the root directory
+	if (g->n_inodes >= (wide ? UNALLOCATED_INODE : NARROW_UNALLOCATED_INODE) ||
+	    g->n_map_blocks + n_inode_blocks >= n_blocks)
+		return -1;
+	return 0;
+}
+
+/**
+ * Load the geometry and the allocation map, if they are not resident yet
+ *
+ * @return 0 if successful, -1 if they can't be read
+ */
+static int oufs_load_master()
+{
+	if (master_loaded)
+		return 0;
+
+	BLOCK block;
+	if (vdisk_read_block(MASTER_BLOCK_REFERENCE, &block) != 0) {
+		fprintf(stderr, "Error: can't read master block\n");
+		return -1;
+	}
+
+	//Disks formatted without a superblock have the default inode table
+	SUPERBLOCK superblock;
+	memcpy(&superblock, block.data.data + SUPERBLOCK_OFFSET, sizeof(superblock));
+	int n_inode_blocks = DEFAULT_N_INODE_BLOCKS;
+	unsigned int features = 0;
+	if (superblock.magic == SUPERBLOCK_MAGIC) {
+		n_inode_blocks = superblock.n_inode_blocks;
+		features = superblock.features;
+	}
+
+	if (oufs_compute_geometry(N_BLOCKS_IN_DISK, n_inode_blocks, features, &geometry) != 0) {
+		fprintf(stderr, "Error: bad superblock\n");
+		return -1;
+	}
+
+	allocation_map = malloc((size_t) geometry.n_map_blocks << BLOCK_SHIFT);
+	map_dirty = calloc(geometry.n_map_blocks, 1);
+	if (allocation_map == NULL || map_dirty == NULL) {
+		fprintf(stderr, "Error: can't allocate allocation map\n");
+		oufs_unload_master();
+		return -1;
+	}
+
+	//The rest of the map, a batch of blocks at a time
+	memcpy(allocation_map, block.data.data, BLOCK_SIZE);
+	BLOCK_REFERENCE refs[VDISK_MAX_RUN_BLOCKS];
+	void *buffers[VDISK_MAX_RUN_BLOCKS];
+	for (int first = 1; first < geometry.n_map_blocks; first += VDISK_MAX_RUN_BLOCKS) {
+		int n = MIN(geometry.n_map_blocks - first, VDISK_MAX_RUN_BLOCKS);
+		for (int i = 0; i < n; i++) {
+			refs[i] = first + i;
+			buffers[i] = allocation_map + ((size_t) (first + i) << BLOCK_SHIFT);
+		}
+		if (vdisk_read_blocks(refs, buffers, n) != 0) {
+			fprintf(stderr, "Error: can't read allocation tables\n");
+			oufs_unload_master();
+			return -1;
+		}
+	}
+
+	master_loaded = 1;
+	master_dirty = 0;
+	vdisk_set_flush_hook(oufs_flush_hook);
+
+	if(debug)
+		fprintf(stderr, "##Mounted: %d inodes, %d blocks of %d bytes\n",
+			geometry.n_inodes, N_BLOCKS_IN_DISK, BLOCK_SIZE);
+	return 0;
+}
+
+/**
+ * Get the geometry of the open disk
+ *
+ * Exits if the disk can't be read: nothing can be located without it
+ *
+ * @return Pointer to the geometry
+ */
+const OUFS_GEOMETRY *oufs_geometry()
+{
+	if (!master_loaded && oufs_load_master() != 0)
+		exit(-1);
+	return &geometry;
+}
+
+/**
+ * Get one of the resident allocation tables
+ *
+ * @param inodes 1 for the inode table, 0 for the block table
+ * @return Pointer to the first byte of the table
+ */
+unsigned char *oufs_allocation_table(int inodes)
+{
+	const OUFS_GEOMETRY *g = oufs_geometry();
+	return allocation_map + (inodes ? g->inode_map_offset : g->block_map_offset);
+}
+
+/**
+ * Write back the resident inode blocks and allocation map blocks that have
+ * changed, VDISK_MAX_RUN_BLOCKS blocks at a time
+ *
+ * @return 0 if successful, -1 on error
+ */
+int oufs_flush()
+{
+	BLOCK_REFERENCE refs[VDISK_MAX_RUN_BLOCKS];
+	void *buffers[VDISK_MAX_RUN_BLOCKS];
+
+	if (master_loaded && inodes_dirty) {
+		unsigned char *raw = malloc((size_t) VDISK_MAX_RUN_BLOCKS << BLOCK_SHIFT);
+		if (raw == NULL)
+			return -1;
+		int n = 0;
+		for (int i = 0; i < geometry.n_inode_blocks; i++) {
+			if (inode_cache_dirty[i]) {
+				buffers[n] = raw + ((size_t) n << BLOCK_SHIFT);
+				memset(buffers[n], 0, BLOCK_SIZE);
+				for (int j = 0; j < geometry.inodes_per_block; j++)
+					oufs_encode_inode(&inode_cache[i][j], (unsigned char *) buffers[n] + j * geometry.inode_size);
+				refs[n] = geometry.inode_table_block + i;
+				n++;
+			}
+			if (n == VDISK_MAX_RUN_BLOCKS || (n > 0 && i == geometry.n_inode_blocks - 1)) {
+				if(debug)
+					fprintf(stderr, "##Writing back %d inode blocks\n", n);
+				if (vdisk_write_blocks(refs, buffers, n) != 0) {
+					free(raw);
+					return -1;
+				}
+				n = 0;
+			}
+		}
+		free(raw);
+		memset(inode_cache_dirty, 0, geometry.n_inode_blocks);
+		inodes_dirty = 0;
+	}
+
+	if (master_loaded && master_dirty) {
+		int n = 0;
+		for (int i = 0; i < geometry.n_map_blocks; i++) {
+			if (map_dirty[i]) {
+				refs[n] = i;
+				buffers[n] = allocation_map + ((size_t) i << BLOCK_SHIFT);
+				n++;
+			}
+			if (n == VDISK_MAX_RUN_BLOCKS || (n > 0 && i == geometry.n_map_blocks - 1)) {
+				if(debug)
+					fprintf(stderr, "##Writing back %d allocation map blocks\n", n);
+				if (vdisk_write_blocks(refs, buffers, n) != 0)
+					return -1;
+				n = 0;
+			}
+		}
+		memset(map_dirty, 0, geometry.n_map_blocks);
+		master_dirty = 0;
+	}
+	return 0;
+}
+
+/**
+ * Get the generation of the file system from its superblock
+ *
+ * @param generation Set to the generation
+ * @return 0 if successful, -1 if the disk has no superblock
+ */
+static int oufs_generation(unsigned int *generation)
+{
+	if (oufs_load_master() != 0)
+		return -1;
+	SUPERBLOCK superblock;
+	memcpy(&superblock, allocation_map + SUPERBLOCK_OFFSET, sizeof(superblock));
+	if (superblock.magic != SUPERBLOCK_MAGIC)
+		return -1;
+	*generation = superblock.generation;
+	return 0;
+}
+
+/**
+ * Note that a directory has gone: directory inodes saved before now (the
+ * cached working directory, ZPWD_INODE) may be stale
+ */
+static void oufs_bump_generation()
+{
+	cwd_cache_valid = 0;
+
+	SUPERBLOCK superblock;
+	if (oufs_load_master() != 0)
+		return;
+	memcpy(&superblock, allocation_map + SUPERBLOCK_OFFSET, sizeof(superblock));
+	if (superblock.magic != SUPERBLOCK_MAGIC)
+		return;
+	superblock.generation++;
+	memcpy(allocation_map + SUPERBLOCK_OFFSET, &superblock, sizeof(superblock));
+	map_dirty[0] = 1;
+	master_dirty = 1;
+}
+
+/**
+ * Load 64 bits of a bitmap, starting at bit word_index * 64.  Bit i of the
+ * result is bit (word_index * 64 + i) of the map.  Bytes past the end of the
+ * map read as 0xff (allocated).
+ *
+ * @param bitmap Allocation bitmap
+ * @param n_bytes Size of the bitmap in bytes
+ * @param word_index Index of the 64-bit word to load
+ * @return The word
+ */
+static unsigned long long oufs_bitmap_load_word(const unsigned char *bitmap, int n_bytes, int word_index)
+{
+	unsigned long long word = ~0ULL;
+	int offset = word_index * 8;
+	int n = MIN(8, n_bytes - offset);
+
+	if (n == 8) {
+		memcpy(&word, bitmap + offset, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		word = __builtin_bswap64(word);
+#endif
+	}
+	else {
+		for (int i = 0; i < n; i++) {
+			word &= ~(0xffULL << (8 * i));
+			word |= (unsigned long long) bitmap[offset + i] << (8 * i);
+		}
+	}
+	return word;
+}
+
+/**
+ * Find the first bit in [start, end) that is set (want_set = 1) or clear
+ * (want_set = 0), 64 bits at a time
+ *
+ * @param bitmap Allocation bitmap
+ * @param n_bits Number of valid bits in the bitmap
+ * @param start First bit to look at
+ * @param end One past the last bit to look at
+ * @param want_set Which kind of bit to look for
+ * @return Index of the bit, or -1 if there is none in the range
+ */
+static int oufs_bitmap_scan(const unsigned char *bitmap, int n_bits, int start, int end, int want_set)
+{
+	int n_bytes = (n_bits + 7) >> 3;
+	end = MIN(end, n_bits);
+
+	for (int w = start >> 6; (w << 6) < end; w++) {
+		unsigned long long word = oufs_bitmap_load_word(bitmap, n_bytes, w);
+		if (!want_set)
+			word = ~word; //Look for set bits in the inverted map
+
+		//Ignore bits before start and from end on
+		if ((w << 6) < start)
+			word &= ~0ULL << (start & 63);
+		if (((w + 1) << 6) > end)
+			word &= ~(~0ULL << (end & 63));
+
+		if (word != 0)
+			return (w << 6) + __builtin_ctzll(word);
+	}
+	return -1;
+}
+
+/**
+ * Find a clear bit, next-fit: scan from hint to the end of the map, then
+ * wrap around to the start
+ *
+ * @param bitmap Allocation bitmap
+ * @param n_bits Number of valid bits in the bitmap
+ * @param hint Bit to start scanning at
+ * @return Index of the clear bit, or -1 if every bit is set
+ */
+int oufs_bitmap_find_clear(const unsigned char *bitmap, int n_bits, int hint)
+{
+	if (hint < 0 || hint >= n_bits)
+		hint = 0;
+
+	int bit = oufs_bitmap_scan(bitmap, n_bits, hint, n_bits, 0);
+	if (bit < 0 && hint > 0)
+		bit = oufs_bitmap_scan(bitmap, n_bits, 0, hint, 0);
+	return bit;
+}
+
+/**
+ * Find the first run of n_run consecutive clear bits at or after hint,
+ * wrapping around to the start of the map if there is none
+ *
+ * @param bitmap Allocation bitmap
+ * @param n_bits Number of valid bits in the bitmap
+ * @param n_run Length of the run
+ * @param hint Bit to start scanning at
+ * @return Index of the first bit of the run, or -1 if there is no such run
+ */
+int oufs_bitmap_find_clear_run(const unsigned char *bitmap, int n_bits, int n_run, int hint)
+{
+	if (hint < 0 || hint >= n_bits)
+		hint = 0;
+	if (n_run <= 0 || n_run > n_bits)
+		return -1;
+
+	//Two passes: from hint, then from the start (runs may cross hint)
+	for (int pass = 0; pass < 2; pass++) {
+		int bit = pass == 0 ? hint : 0;
+		int limit = pass == 0 ? n_bits : MIN(n_bits, hint + n_run - 1);
+
+		while (bit >= 0 && bit + n_run <= limit) {
+			//Start of the next free stretch
+			bit = oufs_bitmap_scan(bitmap, n_bits, bit, limit, 0);
+			if (bit < 0 || bit + n_run > limit)
+				break;
+
+			//End of that stretch
+			int next = oufs_bitmap_scan(bitmap, n_bits, bit, bit + n_run, 1);
+			if (next < 0)
+				return bit; //Long enough
+			bit = next;
+		}
+
+		if (hint == 0)
+			break;
+	}
+	return -1;
+}
+
+/**
+ * Set or clear a run of bits in one of the resident allocation tables, and
+ * mark the map blocks involved for write-back
+ *
+ * @param inodes 1 for the inode table, 0 for the block table
+ * @param first First bit of the run
+ * @param n_run Number of bits
+ * @param value 1 to set the bits, 0 to clear them
+ */
+static void oufs_bitmap_assign(int inodes, int first, int n_run, int value)
+{
+	int offset = inodes ? geometry.inode_map_offset : geometry.block_map_offset;
+	unsigned char *bitmap = allocation_map + offset;
+
+	for (int bit = first; bit < first + n_run; bit++) {
+		if (value)
+			bitmap[bit >> 3] |= (1 << (bit & 7));
+		else
+			bitmap[bit >> 3] &= ~(1 << (bit & 7));
+	}
+
+	for (int i = (offset + (first >> 3)) >> BLOCK_SHIFT; i <= (offset + ((first + n_run - 1) >> 3)) >> BLOCK_SHIFT; i++)
+		map_dirty[i] = 1;
+	master_dirty = 1;
+}
+
 /**
  * Allocate a new data block
  *
@@ -124,50 +622,62 @@ void oufs_clean_block(BLOCK *block)
  */
 BLOCK_REFERENCE oufs_allocate_new_block()
 {
-	BLOCK block;
-	// Read the master block
-	vdisk_read_block(MASTER_BLOCK_REFERENCE, &block);
-
-	// Scan for an available block
-	int block_byte;
-	int flag;
-
-	// Loop over each byte in the allocation table.
-	for(block_byte = 0, flag = 1; flag && block_byte < N_BLOCKS_IN_DISK / 8; ++block_byte) {
-		if(block.master.block_allocated_flag[block_byte] != 0xff) {
-			// Found a byte that has an opening: stop scanning
-			flag = 0;
-			break;
-		};
-	};
-	// Did we find a candidate byte in the table?
-	if(flag == 1) {
+	return(oufs_allocate_new_blocks(1));
+}
+
+/**
+ * Allocate a run of consecutive data blocks
+ *
+ * If one is found, then the corresponding bits in the block allocation table are set
+ *
+ * @param n_blocks Number of blocks in the run
+ * @return The index of the first allocated data block.  If there is no free
+ * run that long, then UNALLOCATED_BLOCK is returned
+ *
+ */
+BLOCK_REFERENCE oufs_allocate_new_blocks(int n_blocks)
+{
+	return(oufs_allocate_new_blocks_near(n_blocks, block_allocation_hint));
+}
+
+/**
+ * Allocate a run of consecutive data blocks, preferring one that starts at
+ * (or after) a given block
+ *
+ * @param n_blocks Number of blocks in the run
+ * @param goal Block to start looking at
+ * @return The index of the first allocated data block.  If there is no free
+ * run that long, then UNALLOCATED_BLOCK is returned
+ *
+ */
+BLOCK_REFERENCE oufs_allocate_new_blocks_near(int n_blocks, BLOCK_REFERENCE goal)
+{
+	// Get the allocation map
+	if (oufs_load_master() != 0)
+		return(UNALLOCATED_BLOCK);
+	unsigned char *table = oufs_allocation_table(0);
+
+	// Scan for available blocks, starting at the goal
+	int hint = goal < (BLOCK_REFERENCE) N_BLOCKS_IN_DISK ? (int) goal : 0;
+	int block_reference;
+	if (n_blocks == 1)
+		block_reference = oufs_bitmap_find_clear(table, N_BLOCKS_IN_DISK, hint);
+	else
+		block_reference = oufs_bitmap_find_clear_run(table, N_BLOCKS_IN_DISK, n_blocks, hint);
+
+	if (block_reference < 0) {
 		// No
 		if(debug)
 			fprintf(stderr, "No blocks\n");
 		return(UNALLOCATED_BLOCK);
 	}
 
-	// Found an available data block
-
-	// Set the block allocated bit
-	// Find the FIRST bit in the byte that is 0 (we scan in bit order: 0 ... 7)
-	int block_bit = oufs_find_open_bit(block.master.block_allocated_flag[block_byte]);
-
-	// Now set the bit in the allocation table
-	block.master.block_allocated_flag[block_byte] |= (1 << block_bit);
-
-	// Write out the updated master block
-	vdisk_write_block(MASTER_BLOCK_REFERENCE, &block);
+	// Now set the bits in the allocation table (written back by oufs_flush())
+	oufs_bitmap_assign(0, block_reference, n_blocks, 1);
+	block_allocation_hint = block_reference + n_blocks;
 
 	if(debug)
-		fprintf(stderr, "Allocating block=%d (%d)\n", block_byte, block_bit);
-
-	// Compute the block index
-	BLOCK_REFERENCE block_reference = (block_byte << 3) + block_bit;
-
-	if(debug)
-		fprintf(stderr, "Allocating block=%d\n", block_reference);
+		fprintf(stderr, "Allocating block=%d (%d blocks)\n", block_reference, n_blocks);
 
 	// Done
 	return(block_reference);
@@ -181,21 +691,15 @@ BLOCK_REFERENCE oufs_allocate_new_block()
  */
 void oufs_deallocate_old_block(BLOCK_REFERENCE old_block_reference)
 {
-	BLOCK block;
-	// Read the master block
-	vdisk_read_block(MASTER_BLOCK_REFERENCE, &block);
+	// Get the allocation map
+	if (oufs_load_master() != 0)
+		return;
 
-	int block_byte = old_block_reference/8;
-	int block_bit = old_block_reference%8;
-
-	// Now set the bit in the allocation table
-	block.master.block_allocated_flag[block_byte] &= (~(1 << block_bit));
-
-	// Write out the updated master block
-	vdisk_write_block(MASTER_BLOCK_REFERENCE, &block);
+	// Now clear the bit in the allocation table (written back by oufs_flush())
+	oufs_bitmap_assign(0, old_block_reference, 1, 0);
 
 	if(debug)
-		fprintf(stderr, "Deallocating block=%d (%d)\n", block_byte, block_bit);
+		fprintf(stderr, "Deallocating block=%d\n", old_block_reference);
 }
 
 /**
@@ -209,47 +713,23 @@ void oufs_deallocate_old_block(BLOCK_REFERENCE old_block_reference)
  */
 INODE_REFERENCE oufs_allocate_new_inode()
 {
-	BLOCK block;
-	// Read the master block
-	vdisk_read_block(MASTER_BLOCK_REFERENCE, &block);
-
-	// Scan for an available block
-	int inode_byte;
-	int flag;
-
-	// Loop over each byte in the allocation table.
-	for(inode_byte = 0, flag = 1; flag && inode_byte < N_INODES / 8; ++inode_byte) {
-		if(block.master.inode_allocated_flag[inode_byte] != 0xff) {
-			// Found a byte that has an opening: stop scanning
-			flag = 0;
-			break;
-		};
-	};
-	// Did we find a candidate byte in the table?
-	if(flag == 1) {
+	// Get the allocation map
+	if (oufs_load_master() != 0)
+		return(UNALLOCATED_INODE);
+
+	// Scan for an available inode, starting where the last allocation ended
+	int inode_reference = oufs_bitmap_find_clear(oufs_allocation_table(1), N_INODES, inode_allocation_hint);
+
+	if (inode_reference < 0) {
 		// No
 		if(debug)
 			fprintf(stderr, "No inodes\n");
 		return(UNALLOCATED_INODE);
 	}
 
-	// Found an available data inode entry
-
-	// Set the block allocated bit
-	// Find the FIRST bit in the byte that is 0 (we scan in bit order: 0 ... 7)
-	int inode_bit = oufs_find_open_bit(block.master.inode_allocated_flag[inode_byte]);
-
-	// Now set the bit in the allocation table
-	block.master.inode_allocated_flag[inode_byte] |= (1 << inode_bit);
-
-	// Write out the updated master block
-	vdisk_write_block(MASTER_BLOCK_REFERENCE, &block);
-
-	if(debug)
-		fprintf(stderr, "Allocating inode=%d (%d)\n", inode_byte, inode_bit);
-
-	// Compute the inode index
-	INODE_REFERENCE inode_reference = (inode_byte << 3) + inode_bit;
+	// Now set the bit in the allocation table (written back by oufs_flush())
+	oufs_bitmap_assign(1, inode_reference, 1, 1);
+	inode_allocation_hint = inode_reference + 1;
 
 	if(debug)
 		fprintf(stderr, "Allocating inode=%d\n", inode_reference);
@@ -266,25 +746,19 @@ INODE_REFERENCE oufs_allocate_new_inode()
  */
 void oufs_deallocate_old_inode(INODE_REFERENCE old_inode_reference)
 {
-	BLOCK block;
-	// Read the master block
-	vdisk_read_block(MASTER_BLOCK_REFERENCE, &block);
-
-	int inode_byte = old_inode_reference/8;
-	int inode_bit = old_inode_reference%8;
-
-	// Now set the bit in the allocation table
-	block.master.inode_allocated_flag[inode_byte] &= (~(1 << inode_bit));
+	// Get the allocation map
+	if (oufs_load_master() != 0)
+		return;
 
-	// Write out the updated master block
-	vdisk_write_block(MASTER_BLOCK_REFERENCE, &block);
+	// Now clear the bit in the allocation table (written back by oufs_flush())
+	oufs_bitmap_assign(1, old_inode_reference, 1, 0);
 
 	if(debug)
-		fprintf(stderr, "Deallocating inode=%d (%d)\n", inode_byte, inode_bit);
+		fprintf(stderr, "Deallocating inode=%d\n", old_inode_reference);
 }
 
 /**
- * Format the virtual disk
+ * Format the virtual disk with the default geometry
  *
  * @param char * virtual_disk_name takes the name of the virtual disk to be formatted
  *
@@ -292,146 +766,2214 @@ void oufs_deallocate_old_inode(INODE_REFERENCE old_inode_reference)
  *
  */
 int oufs_format_disk(char  *virtual_disk_name)
+{
+	return oufs_format_disk_geometry(virtual_disk_name, DEFAULT_BLOCK_SIZE, DEFAULT_N_BLOCKS_IN_DISK, 0, SUPERBLOCK_FEATURE_INDIRECT);
+}
+
+/**
+ * Pick the generation of a file system about to be formatted: one past that
+ * of the file system on the disk now, so that two formats in the same second
+ * still differ
+ *
+ * @param virtual_disk_name Name of the virtual disk
+ * @return The generation
+ */
+static unsigned int oufs_next_generation(const char *virtual_disk_name)
+{
+	SUPERBLOCK superblock;
+	struct stat st;
+	if (master_loaded) {
+		memcpy(&superblock, allocation_map + SUPERBLOCK_OFFSET, sizeof(superblock));
+	}
+	else {
+		//A disk just created has no master block to read yet
+		BLOCK block;
+		if (stat(virtual_disk_name, &st) != 0 || st.st_size < BLOCK_SIZE ||
+		    vdisk_read_block(MASTER_BLOCK_REFERENCE, &block) != 0)
+			return (unsigned int) time(NULL);
+		memcpy(&superblock, block.data.data + SUPERBLOCK_OFFSET, sizeof(superblock));
+	}
+
+	if (superblock.magic != SUPERBLOCK_MAGIC)
+		return (unsigned int) time(NULL);
+	return superblock.generation + 1;
+}
+
+/**
+ * Format the virtual disk with a given geometry, recorded in the superblock
+ *
+ * @param char * virtual_disk_name takes the name of the virtual disk to be formatted
+ * @param block_size Block size in bytes (a power of two, MIN_BLOCK_SIZE ... MAX_BLOCK_SIZE)
+ * @param n_blocks Number of blocks on the disk
+ * @param n_inodes Number of inodes, rounded up to whole inode blocks
+ *                  (0: DEFAULT_N_INODE_BLOCKS blocks of inodes)
+ * @param features Superblock features (SUPERBLOCK_FEATURE_*).  Wide
+ *                  references are turned on if the disk needs them
+ *
+ * @return Success or failure, 0 or -1 respectively
+ *
+ */
+int oufs_format_disk_geometry(char *virtual_disk_name, int block_size, int n_blocks, int n_inodes, unsigned int features)
 {
 	if(debug)
 	fprintf(stderr, "Formatting disk: %s \n", virtual_disk_name);
 
-	//Zero out the whole disk
-	BLOCK_REFERENCE i;
+	//Cookies saved against the old file system must not match the new one
+	unsigned int generation = oufs_next_generation(virtual_disk_name);
+
+	//Drop any resident state of the old file system, then resize the disk
+	oufs_unload_master();
+	if (vdisk_set_geometry(block_size, n_blocks) != 0) {
+		fprintf(stderr, "Error: can't use geometry (%d blocks of %d bytes)\n", n_blocks, block_size);
+		return -1;
+	}
+
+	if (n_blocks > NARROW_UNALLOCATED_BLOCK || n_inodes >= NARROW_UNALLOCATED_INODE)
+		features |= SUPERBLOCK_FEATURE_WIDE_REFS;
+
+	int n_inode_blocks = DEFAULT_N_INODE_BLOCKS;
+	if (n_inodes > 0) {
+		int inodes_per_block = BLOCK_SIZE / oufs_inode_size(features);
+		n_inode_blocks = (n_inodes + inodes_per_block - 1) / inodes_per_block;
+	}
+
+	OUFS_GEOMETRY g;
+	if (oufs_compute_geometry(N_BLOCKS_IN_DISK, n_inode_blocks, features, &g) != 0) {
+		fprintf(stderr, "Error: %d inode blocks don't fit on a disk of %d blocks\n", n_inode_blocks, N_BLOCKS_IN_DISK);
+		return -1;
+	}
+	BLOCK_REFERENCE root_directory_block = g.inode_table_block + g.n_inode_blocks;
+
+	//Zero out the whole disk, one vectored write per run of blocks
+	int i;
 	BLOCK block;
 	oufs_clean_block(&block); //Write the block to be all 0's
 
+	BLOCK_REFERENCE block_references[VDISK_MAX_RUN_BLOCKS];
+	void *block_buffers[VDISK_MAX_RUN_BLOCKS];
+	int n = 0;
 	for(i = 0; i < N_BLOCKS_IN_DISK; i++)
 	{
-		//Write block back to disk
-		vdisk_write_block(i, &block);
+		block_references[n] = i;
+		block_buffers[n] = &block;
+		n++;
+		if (n == VDISK_MAX_RUN_BLOCKS || i == N_BLOCKS_IN_DISK - 1) {
+			//Write blocks back to disk
+			vdisk_write_blocks(block_references, block_buffers, n);
+			n = 0;
+		}
 	}
 
-	//Initialize master blocks, first 10 block allocated, first inode allocated
+	//Initialize the allocation tables: the master block, tables, inode
+	//blocks and root directory block are allocated, and the first inode.
+	//With the default geometry:
 	//Block Allocated Table: 1111 1111 1100 0000 ....
 	//Inode Allocated Table 1000 0000 0000 ....
-	block.master.block_allocated_flag[0] = 0xff;
-	block.master.block_allocated_flag[1] = 0x3;
-	block.master.inode_allocated_flag[0] = 0x1;
-	vdisk_write_block(MASTER_BLOCK_REFERENCE, &block);
-
-	//Initialize first inode
+	size_t map_bytes = (size_t) g.n_map_blocks << BLOCK_SHIFT;
+	unsigned char *map = calloc(map_bytes, 1);
+	if (map == NULL) {
+		fprintf(stderr, "Error: can't allocate allocation map\n");
+		return -1;
+	}
+	map[g.inode_map_offset] = 0x1;
+	for (i = 0; i <= root_directory_block; i++)
+		map[g.block_map_offset + (i >> 3)] |= 1 << (i & 7);
+
+	//Superblock
+	SUPERBLOCK superblock;
+	memset(&superblock, 0, sizeof(superblock));
+	superblock.magic = SUPERBLOCK_MAGIC;
+	superblock.version = SUPERBLOCK_VERSION;
+	superblock.block_shift = BLOCK_SHIFT;
+	superblock.n_blocks = N_BLOCKS_IN_DISK;
+	superblock.n_inode_blocks = g.n_inode_blocks;
+	superblock.features = features;
+	superblock.generation = generation;
+	memcpy(map + SUPERBLOCK_OFFSET, &superblock, sizeof(superblock));
+
+	for (i = 0; i < g.n_map_blocks; i++)
+		vdisk_write_block(i, map + ((size_t) i << BLOCK_SHIFT));
+	free(map);
+
+	//Initialize all inodes to unallocated inodes, a block at a time
 	INODE inode;
 	oufs_clean_inode(&inode);
+	for (i = 0; i < g.inodes_per_block; i++)
+		oufs_encode_inode(&inode, block.data.data + i * g.inode_size);
+	for (i = 0; i < g.n_inode_blocks; i += n) {
+		n = MIN(g.n_inode_blocks - i, VDISK_MAX_RUN_BLOCKS);
+		for (int j = 0; j < n; j++) {
+			block_references[j] = g.inode_table_block + i + j;
+			block_buffers[j] = &block;
+		}
+		vdisk_write_blocks(block_references, block_buffers, n);
+	}
+
+	//Initialize first inode
 	inode.type = IT_DIRECTORY;
 	inode.n_references = 1;
-	inode.data[0] = ROOT_DIRECTORY_BLOCK; //Point inode to first nonmaster/noninode block
+	inode.data[0] = root_directory_block; //Point inode to first nonmaster/noninode block
 	inode.size = 2; //Include . and .. directories to be added
 
-	oufs_write_inode_by_reference(MASTER_BLOCK_REFERENCE, &inode);
+	oufs_write_inode_by_reference(0, &inode);
+
+	//Initialize root directory block with . and ..
+	//Use oufs_clean_directory_block()
+
+	oufs_clean_directory_block(0, 0, &block);
+	oufs_write_directory_block(root_directory_block, &block); //Initialize the root directory
+
+	return 0;
+}
+
+/**
+ * Convert an inode from its on-disk form
+ *
+ * @param raw The inode as stored in an inode block
+ * @param inode Filled in with the inode
+ */
+void oufs_decode_inode(const unsigned char *raw, INODE *inode)
+{
+	if (oufs_geometry()->features & SUPERBLOCK_FEATURE_WIDE_REFS) {
+		memcpy(inode, raw, sizeof(INODE));
+		return;
+	}
+
+	NARROW_INODE narrow;
+	memcpy(&narrow, raw, sizeof(narrow));
+	inode->type = narrow.type;
+	inode->n_references = narrow.n_references;
+	inode->reserved = 0;
+	for (int i = 0; i < BLOCKS_PER_INODE; i++)
+		inode->data[i] = narrow.data[i] == NARROW_UNALLOCATED_BLOCK ? UNALLOCATED_BLOCK : narrow.data[i];
+	inode->size = narrow.size;
+}
+
+/**
+ * Convert an inode to its on-disk form
+ *
+ * @param inode The inode
+ * @param raw Where the inode goes in an inode block
+ */
+void oufs_encode_inode(const INODE *inode, unsigned char *raw)
+{
+	if (oufs_geometry()->features & SUPERBLOCK_FEATURE_WIDE_REFS) {
+		memcpy(raw, inode, sizeof(INODE));
+		return;
+	}
+
+	//Truncation maps UNALLOCATED_BLOCK to NARROW_UNALLOCATED_BLOCK
+	NARROW_INODE narrow;
+	narrow.type = inode->type;
+	narrow.n_references = inode->n_references;
+	for (int i = 0; i < BLOCKS_PER_INODE; i++)
+		narrow.data[i] = (unsigned short) inode->data[i];
+	narrow.size = inode->size;
+	memcpy(raw, &narrow, sizeof(narrow));
+}
+
+/**
+ * Read a directory block into its in-memory form (block->directory)
+ *
+ * @param block_ref Block holding the directory entries
+ * @param block Filled in with the decoded entries
+ * @return 0 if successful, < 0 on error
+ */
+int oufs_read_directory_block(BLOCK_REFERENCE block_ref, BLOCK *block)
+{
+	const OUFS_GEOMETRY *g = oufs_geometry();
+	if (g->features & SUPERBLOCK_FEATURE_WIDE_REFS)
+		return vdisk_read_block(block_ref, block);
+
+	DATA_BLOCK raw;
+	int ret = vdisk_read_block(block_ref, &raw);
+	if (ret != 0)
+		return ret;
+
+	NARROW_DIRECTORY_ENTRY *narrow = (NARROW_DIRECTORY_ENTRY *) raw.data;
+	for (int i = 0; i < g->directory_entries_per_block; i++) {
+		DIRECTORY_ENTRY *entry = &block->directory.entry[i];
+		memcpy(entry->name, narrow[i].name, FILE_NAME_SIZE);
+		entry->reserved = 0;
+		entry->inode_reference = narrow[i].inode_reference == NARROW_UNALLOCATED_INODE ?
+			UNALLOCATED_INODE : narrow[i].inode_reference;
+	}
+	return 0;
+}
+
+/**
+ * Write a directory block from its in-memory form (block->directory)
+ *
+ * @param block_ref Block to hold the directory entries
+ * @param block The entries
+ * @return 0 if successful, < 0 on error
+ */
+int oufs_write_directory_block(BLOCK_REFERENCE block_ref, BLOCK *block)
+{
+	const OUFS_GEOMETRY *g = oufs_geometry();
+	if (g->features & SUPERBLOCK_FEATURE_WIDE_REFS)
+		return vdisk_write_block(block_ref, block);
+
+	//Truncation maps UNALLOCATED_INODE to NARROW_UNALLOCATED_INODE
+	DATA_BLOCK raw;
+	memset(raw.data, 0, BLOCK_SIZE);
+	NARROW_DIRECTORY_ENTRY *narrow = (NARROW_DIRECTORY_ENTRY *) raw.data;
+	for (int i = 0; i < g->directory_entries_per_block; i++) {
+		memcpy(narrow[i].name, block->directory.entry[i].name, FILE_NAME_SIZE);
+		narrow[i].inode_reference = (unsigned short) block->directory.entry[i].inode_reference;
+	}
+	return vdisk_write_block(block_ref, &raw);
+}
+
+/**
+ * Write back an indirect block if it has changed
+ *
+ * @param ind The indirect block
+ * @return 0 if successful, < 0 on error
+ */
+static int oufs_indirect_flush(OUFS_INDIRECT *ind)
+{
+	if (!ind->dirty)
+		return 0;
+
+	DATA_BLOCK raw;
+	int n = REFERENCES_PER_BLOCK;
+	if (oufs_geometry()->features & SUPERBLOCK_FEATURE_WIDE_REFS) {
+		memcpy(raw.data, ind->ref, n * sizeof(BLOCK_REFERENCE));
+	}
+	else {
+		//Truncation maps UNALLOCATED_BLOCK to NARROW_UNALLOCATED_BLOCK
+		unsigned short *narrow = (unsigned short *) raw.data;
+		for (int i = 0; i < n; i++)
+			narrow[i] = (unsigned short) ind->ref[i];
+	}
+	ind->dirty = 0;
+	return vdisk_write_block(ind->block_ref, &raw);
+}
+
+/**
+ * Load an indirect block, writing back the one held before if needed
+ *
+ * @param ind Holds the indirect block
+ * @param block_ref Block to load
+ * @return 0 if successful, < 0 on error
+ */
+static int oufs_indirect_load(OUFS_INDIRECT *ind, BLOCK_REFERENCE block_ref)
+{
+	if (ind->block_ref == block_ref)
+		return 0;
+	if (oufs_indirect_flush(ind) != 0)
+		return -1;
+
+	DATA_BLOCK raw;
+	ind->block_ref = UNALLOCATED_BLOCK;
+	if (vdisk_read_block(block_ref, &raw) != 0)
+		return -1;
+
+	int n = REFERENCES_PER_BLOCK;
+	if (oufs_geometry()->features & SUPERBLOCK_FEATURE_WIDE_REFS) {
+		memcpy(ind->ref, raw.data, n * sizeof(BLOCK_REFERENCE));
+	}
+	else {
+		unsigned short *narrow = (unsigned short *) raw.data;
+		for (int i = 0; i < n; i++)
+			ind->ref[i] = narrow[i] == NARROW_UNALLOCATED_BLOCK ? UNALLOCATED_BLOCK : narrow[i];
+	}
+	ind->block_ref = block_ref;
+	return 0;
+}
+
+/**
+ * Allocate an empty indirect block, writing back the one held before if
+ * needed.  It reaches the disk when it is flushed
+ *
+ * @param ind Holds the new indirect block
+ * @return The new block, or UNALLOCATED_BLOCK if there is no room
+ */
+static BLOCK_REFERENCE oufs_indirect_new(OUFS_INDIRECT *ind)
+{
+	if (oufs_indirect_flush(ind) != 0)
+		return UNALLOCATED_BLOCK;
+
+	BLOCK_REFERENCE block_ref = oufs_allocate_new_block();
+	if (block_ref == UNALLOCATED_BLOCK)
+		return UNALLOCATED_BLOCK;
+
+	for (int i = 0; i < REFERENCES_PER_BLOCK; i++)
+		ind->ref[i] = UNALLOCATED_BLOCK;
+	ind->block_ref = block_ref;
+	ind->dirty = 1;
+	return block_ref;
+}
+
+/**
+ * Start a walk over the block map of an inode
+ *
+ * @param map Walk state
+ * @param inode The inode; updated in place as blocks are allocated
+ */
+void oufs_bmap_begin(OUFS_BMAP *map, INODE *inode)
+{
+	map->inode = inode;
+	map->inode_dirty = 0;
+	map->top.block_ref = UNALLOCATED_BLOCK;
+	map->top.dirty = 0;
+	map->leaf.block_ref = UNALLOCATED_BLOCK;
+	map->leaf.dirty = 0;
+	map->extents_loaded = 0;
+	map->extents_dirty = 0;
+	map->extents = NULL;
+	map->n_extents = 0;
+	map->max_extents = 0;
+	map->chain = NULL;
+	map->n_chain = 0;
+	map->cursor = 0;
+	map->cursor_index = 0;
+}
+
+/**
+ * Does an inode's block map go on into indirect blocks?  Directories get
+ * them on any disk formatted with indirect blocks or extents
+ *
+ * @param inode The inode
+ * @return 1 if so, 0 if it has direct blocks only
+ */
+static int oufs_indirect_mapped(const INODE *inode)
+{
+	unsigned int features = oufs_geometry()->features;
+	if (inode->type == IT_DIRECTORY)
+		return (features & (SUPERBLOCK_FEATURE_INDIRECT | SUPERBLOCK_FEATURE_EXTENTS)) != 0;
+	return (features & SUPERBLOCK_FEATURE_INDIRECT) && inode->type == IT_FILE;
+}
+
+/**
+ * Find the slot that holds the block reference for a file block, loading
+ * (or, if allocating, creating) the indirect blocks on the way
+ *
+ * @param map Walk state
+ * @param index File block index
+ * @param allocate 1 to create missing indirect blocks
+ * @param dirty Set to the flag to raise if the slot is changed
+ * @return The slot, or NULL if there is none (past the largest file, a
+ *         missing indirect block, or no room for one)
+ */
+static BLOCK_REFERENCE *oufs_bmap_slot(OUFS_BMAP *map, int index, int allocate, int **dirty)
+{
+	INODE *inode = map->inode;
+	int indirect = oufs_indirect_mapped(inode);
+	int n_direct = indirect ? N_DIRECT_BLOCKS : BLOCKS_PER_INODE;
+
+	if (index < n_direct) {
+		*dirty = &map->inode_dirty;
+		return &inode->data[index];
+	}
+	if (!indirect)
+		return NULL;
+
+	index -= n_direct;
+	int n = REFERENCES_PER_BLOCK;
+	BLOCK_REFERENCE *leaf_slot;
+	int *leaf_slot_dirty;
+
+	if (index < n) {
+		//Single indirect
+		leaf_slot = &inode->data[SINGLE_INDIRECT_SLOT];
+		leaf_slot_dirty = &map->inode_dirty;
+	}
+	else {
+		//Double indirect
+		index -= n;
+		if (index / n >= n)
+			return NULL;
+
+		BLOCK_REFERENCE *top_slot = &inode->data[DOUBLE_INDIRECT_SLOT];
+		if (*top_slot == UNALLOCATED_BLOCK) {
+			if (!allocate || (*top_slot = oufs_indirect_new(&map->top)) == UNALLOCATED_BLOCK)
+				return NULL;
+			map->inode_dirty = 1;
+		}
+		else if (oufs_indirect_load(&map->top, *top_slot) != 0) {
+			return NULL;
+		}
+
+		leaf_slot = &map->top.ref[index / n];
+		leaf_slot_dirty = &map->top.dirty;
+		index %= n;
+	}
+
+	if (*leaf_slot == UNALLOCATED_BLOCK) {
+		if (!allocate || (*leaf_slot = oufs_indirect_new(&map->leaf)) == UNALLOCATED_BLOCK)
+			return NULL;
+		*leaf_slot_dirty = 1;
+	}
+	else if (oufs_indirect_load(&map->leaf, *leaf_slot) != 0) {
+		return NULL;
+	}
+
+	*dirty = &map->leaf.dirty;
+	return &map->leaf.ref[index];
+}
+
+/**
+ * Is the block map of an inode a list of extents?
+ *
+ * @param inode The inode
+ * @return 1 if so, 0 if it is a list of blocks
+ */
+static int oufs_extent_mapped(const INODE *inode)
+{
+	return (oufs_geometry()->features & SUPERBLOCK_FEATURE_EXTENTS) && inode->type == IT_FILE;
+}
+
+/**
+ * Number of extent blocks needed to hold a number of extents
+ *
+ * @param n_extents Number of extents
+ * @return Length of the chain of extent blocks
+ */
+static int oufs_extent_chain_length(int n_extents)
+{
+	int per_block = (REFERENCES_PER_BLOCK - 1) / 2;
+	if (n_extents <= N_INODE_EXTENTS)
+		return 0;
+	return (n_extents - N_INODE_EXTENTS + per_block - 1) / per_block;
+}
+
+/**
+ * Make room for a number of extents in the list, both in memory and in
+ * the chain of extent blocks, so that adding them later cannot fail
+ *
+ * @param map Walk state
+ * @param n_extents Number of extents to make room for
+ * @return 0 if successful, -1 if out of memory or disk space
+ */
+static int oufs_extents_reserve(OUFS_BMAP *map, int n_extents)
+{
+	if (n_extents > map->max_extents) {
+		int max_extents = MAX(n_extents, 2 * map->max_extents);
+		OUFS_EXTENT *extents = realloc(map->extents, max_extents * sizeof(OUFS_EXTENT));
+		if (extents == NULL)
+			return -1;
+		map->extents = extents;
+		map->max_extents = max_extents;
+	}
+
+	int n_chain = oufs_extent_chain_length(n_extents);
+	while (map->n_chain < n_chain) {
+		BLOCK_REFERENCE *chain = realloc(map->chain, (map->n_chain + 1) * sizeof(BLOCK_REFERENCE));
+		if (chain == NULL)
+			return -1;
+		map->chain = chain;
+
+		BLOCK_REFERENCE block_ref = oufs_allocate_new_block();
+		if (block_ref == UNALLOCATED_BLOCK)
+			return -1;
+		map->chain[map->n_chain++] = block_ref;
+		map->extents_dirty = 1;
+	}
+	return 0;
+}
+
+/**
+ * Insert an extent into the list; room must have been reserved
+ *
+ * @param map Walk state
+ * @param k Position in the list
+ * @param start First disk block, or UNALLOCATED_BLOCK for a hole
+ * @param length Number of blocks
+ */
+static void oufs_extent_insert(OUFS_BMAP *map, int k, BLOCK_REFERENCE start, unsigned int length)
+{
+	memmove(&map->extents[k + 1], &map->extents[k], (map->n_extents - k) * sizeof(OUFS_EXTENT));
+	map->extents[k].start = start;
+	map->extents[k].length = length;
+	map->n_extents++;
+}
+
+/**
+ * Remove an extent from the list
+ *
+ * @param map Walk state
+ * @param k Position in the list
+ */
+static void oufs_extent_remove(OUFS_BMAP *map, int k)
+{
+	map->n_extents--;
+	memmove(&map->extents[k], &map->extents[k + 1], (map->n_extents - k) * sizeof(OUFS_EXTENT));
+}
+
+/**
+ * Read the extent list of the inode (and its chain of extent blocks) into
+ * memory, if that has not been done yet
+ *
+ * @param map Walk state
+ * @return 0 if successful, -1 on error
+ */
+static int oufs_extents_load(OUFS_BMAP *map)
+{
+	if (map->extents_loaded)
+		return 0;
+
+	INODE *inode = map->inode;
+	BLOCK_REFERENCE *pairs = inode->data;
+	int n_pairs = N_INODE_EXTENTS;
+	BLOCK_REFERENCE next = inode->data[EXTENT_OVERFLOW_SLOT];
+	OUFS_INDIRECT ind;
+	ind.block_ref = UNALLOCATED_BLOCK;
+	ind.dirty = 0;
+
+	for (;;) {
+		for (int i = 0; i < n_pairs; i++) {
+			unsigned int length = pairs[2 * i + 1];
+			if (length == 0 || length == UNALLOCATED_BLOCK)
+				break;
+			if (oufs_extents_reserve(map, map->n_extents + 1) != 0)
+				return -1;
+			oufs_extent_insert(map, map->n_extents, pairs[2 * i], length);
+		}
+
+		//A chain cannot be longer than the disk
+		if (next == UNALLOCATED_BLOCK || map->n_chain >= N_BLOCKS_IN_DISK)
+			break;
+		BLOCK_REFERENCE *chain = realloc(map->chain, (map->n_chain + 1) * sizeof(BLOCK_REFERENCE));
+		if (chain == NULL || oufs_indirect_load(&ind, next) != 0) {
+			if (chain != NULL)
+				map->chain = chain;
+			return -1;
+		}
+		map->chain = chain;
+		map->chain[map->n_chain++] = next;
+
+		next = ind.ref[0];
+		pairs = &ind.ref[1];
+		n_pairs = (REFERENCES_PER_BLOCK - 1) / 2;
+	}
+
+	map->extents_loaded = 1;
+	map->cursor = 0;
+	map->cursor_index = 0;
+	return 0;
+}
+
+/**
+ * Write the extent list back into the inode and its chain of extent
+ * blocks, releasing the extent blocks it no longer needs
+ *
+ * @param map Walk state
+ * @return 0 if successful, < 0 on error
+ */
+static int oufs_extents_store(OUFS_BMAP *map)
+{
+	INODE *inode = map->inode;
+	int n_chain = oufs_extent_chain_length(map->n_extents);
+	while (map->n_chain > n_chain)
+		oufs_deallocate_old_block(map->chain[--map->n_chain]);
+
+	//The extents that fit in the inode
+	int k = 0;
+	for (int i = 0; i < N_INODE_EXTENTS; i++, k++) {
+		inode->data[2 * i] = k < map->n_extents ? map->extents[k].start : UNALLOCATED_BLOCK;
+		inode->data[2 * i + 1] = k < map->n_extents ? map->extents[k].length : UNALLOCATED_BLOCK;
+	}
+	inode->data[EXTENT_OVERFLOW_SLOT] = n_chain > 0 ? map->chain[0] : UNALLOCATED_BLOCK;
+	map->inode_dirty = 1;
+
+	//The rest, a block of the chain at a time
+	int ret = 0;
+	int per_block = (REFERENCES_PER_BLOCK - 1) / 2;
+	OUFS_INDIRECT ind;
+	for (int c = 0; c < n_chain; c++) {
+		ind.block_ref = map->chain[c];
+		ind.dirty = 1;
+		for (int i = 0; i < REFERENCES_PER_BLOCK; i++)
+			ind.ref[i] = UNALLOCATED_BLOCK;
+		ind.ref[0] = c + 1 < n_chain ? map->chain[c + 1] : UNALLOCATED_BLOCK;
+		for (int i = 0; i < per_block && k < map->n_extents; i++, k++) {
+			ind.ref[1 + 2 * i] = map->extents[k].start;
+			ind.ref[2 + 2 * i] = map->extents[k].length;
+		}
+		if (oufs_indirect_flush(&ind) != 0)
+			ret = -1;
+	}
+
+	map->extents_dirty = 0;
+	return ret;
+}
+
+/**
+ * Find the disk block of a file block in the extent list, leaving the
+ * cursor on the extent that covers it (or past the last extent)
+ *
+ * @param map Walk state
+ * @param index File block index
+ * @return The disk block, or UNALLOCATED_BLOCK for a hole
+ */
+static BLOCK_REFERENCE oufs_extent_lookup(OUFS_BMAP *map, unsigned int index)
+{
+	if (index < map->cursor_index) {
+		map->cursor = 0;
+		map->cursor_index = 0;
+	}
+	while (map->cursor < map->n_extents &&
+	       index - map->cursor_index >= map->extents[map->cursor].length) {
+		map->cursor_index += map->extents[map->cursor].length;
+		map->cursor++;
+	}
+
+	if (map->cursor == map->n_extents || map->extents[map->cursor].start == UNALLOCATED_BLOCK)
+		return UNALLOCATED_BLOCK;
+	return map->extents[map->cursor].start + (index - map->cursor_index);
+}
+
+/**
+ * Number of extents that storing a block may add to the list
+ *
+ * @param map Walk state, with the cursor left by oufs_extent_lookup()
+ * @param index File block index, not stored yet
+ * @return Number of extents
+ */
+static int oufs_extent_growth(OUFS_BMAP *map, unsigned int index)
+{
+	if (map->cursor < map->n_extents)
+		return 2; //Splits a hole
+	return (index - map->cursor_index + MAX_EXTENT_BLOCKS - 1) / MAX_EXTENT_BLOCKS + 1;
+}
+
+/**
+ * Store a file block that the file does not have yet, growing the
+ * neighbouring extents when the disk block continues them.  Room must have
+ * been reserved (see oufs_extent_growth())
+ *
+ * @param map Walk state, with the cursor left by oufs_extent_lookup()
+ * @param index File block index
+ * @param block_ref Disk block
+ */
+static void oufs_extent_store(OUFS_BMAP *map, unsigned int index, BLOCK_REFERENCE block_ref)
+{
+	OUFS_EXTENT *extents;
+	int k = map->cursor;
+	int d;
+	unsigned int before = index - map->cursor_index;
+	unsigned int after = 0;
+
+	if (k == map->n_extents) {
+		//Past the end: a hole up to the block, then the block
+		while (before > 0) {
+			unsigned int length = MIN(before, MAX_EXTENT_BLOCKS);
+			oufs_extent_insert(map, k++, UNALLOCATED_BLOCK, length);
+			before -= length;
+		}
+		oufs_extent_insert(map, k, block_ref, 1);
+		d = k;
+	}
+	else {
+		//In a hole: split it around the block
+		after = map->extents[k].length - before - 1;
+		if (after > 0)
+			oufs_extent_insert(map, k + 1, UNALLOCATED_BLOCK, after);
+		if (before > 0) {
+			map->extents[k].length = before;
+			oufs_extent_insert(map, ++k, block_ref, 1);
+		}
+		else {
+			map->extents[k].start = block_ref;
+			map->extents[k].length = 1;
+		}
+		d = k;
+	}
+	extents = map->extents;
+
+	//Merge with the extent before, and the one after, when contiguous
+	if (before == 0 && d > 0 && extents[d - 1].start != UNALLOCATED_BLOCK &&
+	    extents[d - 1].start + extents[d - 1].length == block_ref &&
+	    extents[d - 1].length < MAX_EXTENT_BLOCKS) {
+		extents[d - 1].length++;
+		oufs_extent_remove(map, d);
+		d--;
+	}
+	if (after == 0 && d + 1 < map->n_extents && extents[d + 1].start != UNALLOCATED_BLOCK &&
+	    block_ref + 1 == extents[d + 1].start &&
+	    extents[d].length + extents[d + 1].length <= MAX_EXTENT_BLOCKS) {
+		extents[d].length += extents[d + 1].length;
+		oufs_extent_remove(map, d + 1);
+	}
+
+	map->cursor = d;
+	map->cursor_index = index - (block_ref - extents[d].start);
+	map->extents_dirty = 1;
+}
+
+/**
+ * Map a run of consecutive file blocks through the extent list.  Blocks
+ * are allocated next to the ones before them, so that a file written in
+ * order is a few long extents
+ *
+ * See oufs_bmap()
+ */
+static int oufs_bmap_extent_run(OUFS_BMAP *map, int first, int n_blocks, BLOCK_REFERENCE *block_refs, int allocate)
+{
+	int i = 0;
+	if (oufs_extents_load(map) != 0) {
+		if (allocate)
+			return 0;
+		for (i = 0; i < n_blocks; i++)
+			block_refs[i] = UNALLOCATED_BLOCK;
+		return n_blocks;
+	}
+
+	for (i = 0; i < n_blocks; i++) {
+		unsigned int index = first + i;
+		BLOCK_REFERENCE block_ref = oufs_extent_lookup(map, index);
+
+		if (block_ref == UNALLOCATED_BLOCK && allocate) {
+			//Aim for the block after the previous file block
+			BLOCK_REFERENCE goal = i > 0 ? block_refs[i - 1] : UNALLOCATED_BLOCK;
+			if (i == 0 && index > 0) {
+				goal = oufs_extent_lookup(map, index - 1);
+				oufs_extent_lookup(map, index);
+			}
+			goal = goal == UNALLOCATED_BLOCK ? (BLOCK_REFERENCE) block_allocation_hint : goal + 1;
+
+			block_ref = oufs_allocate_new_blocks_near(1, goal);
+			if (block_ref == UNALLOCATED_BLOCK)
+				break;
+			if (oufs_extents_reserve(map, map->n_extents + oufs_extent_growth(map, index)) != 0) {
+				oufs_deallocate_old_block(block_ref);
+				break;
+			}
+			oufs_extent_store(map, index, block_ref);
+		}
+		block_refs[i] = block_ref;
+	}
+	return i;
+}
+
+/**
+ * Release the blocks of an extent-mapped file from a given file block on
+ *
+ * @param map Walk state
+ * @param n_blocks Number of file blocks to keep
+ */
+static void oufs_extents_truncate(OUFS_BMAP *map, unsigned int n_blocks)
+{
+	if (oufs_extents_load(map) != 0 || oufs_load_master() != 0)
+		return;
+
+	unsigned int base = 0;
+	int n_kept = 0;
+	int changed = 0;
+	for (int k = 0; k < map->n_extents; k++) {
+		OUFS_EXTENT *extent = &map->extents[k];
+		unsigned int kept = n_blocks > base ? MIN(n_blocks - base, extent->length) : 0;
+		base += extent->length;
+		if (kept == extent->length) {
+			n_kept = k + 1;
+			continue;
+		}
+
+		if (extent->start != UNALLOCATED_BLOCK)
+			oufs_bitmap_assign(0, extent->start + kept, extent->length - kept, 0);
+		extent->length = kept;
+		changed = 1;
+		if (kept > 0)
+			n_kept = k + 1;
+	}
+
+	//No hole at the end
+	while (n_kept > 0 && map->extents[n_kept - 1].start == UNALLOCATED_BLOCK) {
+		n_kept--;
+		changed = 1;
+	}
+	if (changed) {
+		map->n_extents = n_kept;
+		map->extents_dirty = 1;
+	}
+	map->cursor = 0;
+	map->cursor_index = 0;
+}
+
+/**
+ * Give the extent list of an extent-mapped file
+ *
+ * @param map Walk state (see oufs_bmap_begin())
+ * @param extents Set to the list, valid until the walk ends
+ * @return Number of extents, or -1 if the file is not extent-mapped (or
+ *         on error)
+ */
+int oufs_bmap_extents(OUFS_BMAP *map, const OUFS_EXTENT **extents)
+{
+	if (!oufs_extent_mapped(map->inode) || oufs_extents_load(map) != 0)
+		return -1;
+	*extents = map->extents;
+	return map->n_extents;
+}
+
+/**
+ * Map a run of consecutive file blocks to disk blocks
+ *
+ * @param map Walk state (see oufs_bmap_begin())
+ * @param first Index of the first file block
+ * @param n_blocks Number of file blocks
+ * @param block_refs Filled in with the disk blocks.  UNALLOCATED_BLOCK for
+ *                   blocks the file does not have (when not allocating)
+ * @param allocate 1 to allocate the blocks the file does not have yet
+ * @return Number of blocks mapped: less than n_blocks when the end of the
+ *         largest possible file, or of the free space, is reached
+ */
+int oufs_bmap(OUFS_BMAP *map, int first, int n_blocks, BLOCK_REFERENCE *block_refs, int allocate)
+{
+	if (oufs_extent_mapped(map->inode))
+		return oufs_bmap_extent_run(map, first, n_blocks, block_refs, allocate);
+
+	int i;
+	for (i = 0; i < n_blocks; i++) {
+		int *dirty;
+		BLOCK_REFERENCE *slot = oufs_bmap_slot(map, first + i, allocate, &dirty);
+		if (slot == NULL) {
+			if (allocate)
+				break;
+			block_refs[i] = UNALLOCATED_BLOCK;
+			continue;
+		}
+
+		if (*slot == UNALLOCATED_BLOCK && allocate) {
+			BLOCK_REFERENCE block_ref = oufs_allocate_new_block();
+			if (block_ref == UNALLOCATED_BLOCK)
+				break;
+			*slot = block_ref;
+			*dirty = 1;
+		}
+		block_refs[i] = *slot;
+	}
+	return i;
+}
+
+/**
+ * Finish a walk: write back the indirect (or extent) blocks it changed.
+ * The inode is not written; map->inode_dirty says whether it needs to be
+ *
+ * @param map Walk state
+ * @return 0 if successful, < 0 on error
+ */
+int oufs_bmap_end(OUFS_BMAP *map)
+{
+	int ret = oufs_indirect_flush(&map->leaf);
+	if (oufs_indirect_flush(&map->top) != 0)
+		ret = -1;
+	if (map->extents_dirty && oufs_extents_store(map) != 0)
+		ret = -1;
+
+	free(map->extents);
+	free(map->chain);
+	map->extents = NULL;
+	map->chain = NULL;
+	map->n_extents = map->max_extents = map->n_chain = 0;
+	map->extents_loaded = 0;
+	return ret;
+}
+
+/**
+ * Release the blocks of an indirect tree from a given data block on
+ *
+ * @param block_ref Root of the tree; set to UNALLOCATED_BLOCK if it goes
+ * @param keep Number of data blocks of the tree to keep
+ * @param depth 0 for a data block, 1 for a single indirect block, 2 for a
+ *              double indirect block
+ */
+static void oufs_truncate_tree(BLOCK_REFERENCE *block_ref, long keep, int depth)
+{
+	if (*block_ref == UNALLOCATED_BLOCK)
+		return;
+
+	if (depth > 0) {
+		OUFS_INDIRECT ind;
+		ind.block_ref = UNALLOCATED_BLOCK;
+		ind.dirty = 0;
+		if (oufs_indirect_load(&ind, *block_ref) != 0)
+			return;
+
+		//Data blocks below each entry
+		long span = depth == 1 ? 1 : REFERENCES_PER_BLOCK;
+		for (int i = 0; i < REFERENCES_PER_BLOCK; i++) {
+			if (keep - i * span >= span)
+				continue; //Entirely kept
+			BLOCK_REFERENCE before = ind.ref[i];
+			oufs_truncate_tree(&ind.ref[i], keep - i * span, depth - 1);
+			if (ind.ref[i] != before)
+				ind.dirty = 1;
+		}
+
+		if (keep > 0) {
+			oufs_indirect_flush(&ind);
+			return;
+		}
+	}
+
+	if (keep <= 0) {
+		oufs_deallocate_old_block(*block_ref);
+		*block_ref = UNALLOCATED_BLOCK;
+	}
+}
+
+/**
+ * Release the blocks of a file from a given file block on, including
+ * indirect blocks that are no longer needed.  The inode is updated but not
+ * written
+ *
+ * @param inode The file's inode
+ * @param n_blocks Number of file blocks to keep
+ */
+void oufs_bmap_truncate(INODE *inode, int n_blocks)
+{
+	if (oufs_extent_mapped(inode)) {
+		OUFS_BMAP map;
+		oufs_bmap_begin(&map, inode);
+		oufs_extents_truncate(&map, n_blocks);
+		oufs_bmap_end(&map);
+		return;
+	}
+
+	int indirect = oufs_indirect_mapped(inode);
+	int n_direct = indirect ? N_DIRECT_BLOCKS : BLOCKS_PER_INODE;
+
+	for (int i = n_blocks; i < n_direct; i++)
+		oufs_truncate_tree(&inode->data[i], 0, 0);
+
+	if (indirect) {
+		long n = REFERENCES_PER_BLOCK;
+		oufs_truncate_tree(&inode->data[SINGLE_INDIRECT_SLOT], (long) n_blocks - n_direct, 1);
+		oufs_truncate_tree(&inode->data[DOUBLE_INDIRECT_SLOT], (long) n_blocks - n_direct - n, 2);
+	}
+}
+
+/**
+ * Count the data blocks of a file or directory (not counting indirect or
+ * extent blocks)
+ *
+ * @param inode The inode
+ * @return Number of data blocks
+ */
+int oufs_inode_n_blocks(INODE *inode)
+{
+	BLOCK_REFERENCE refs[OUFS_IO_BATCH];
+	OUFS_BMAP map;
+	oufs_bmap_begin(&map, inode);
+
+	//A directory's blocks are file blocks 0 to n-1; a file's end at its size
+	int file = inode->type == IT_FILE;
+	long limit = file ? ((long) inode->size + BLOCK_SIZE - 1) >> BLOCK_SHIFT : LONG_MAX;
+	int n = 0;
+	for (long first = 0; first < limit; first += OUFS_IO_BATCH) {
+		int want = (int) MIN(OUFS_IO_BATCH, limit - first);
+		int got = oufs_bmap(&map, first, want, refs, 0);
+		int j;
+		for (j = 0; j < got && (file || refs[j] != UNALLOCATED_BLOCK); j++)
+			n += refs[j] != UNALLOCATED_BLOCK;
+		if (j < want)
+			break;
+	}
+	oufs_bmap_end(&map);
+	return n;
+}
+
+/**
+ * Make sure that the resident inode table exists (its inode blocks are
+ * read on first use)
+ *
+ * @return 0 if successful, -1 if out of memory
+ */
+static int oufs_inode_cache_init(void)
+{
+	if (inode_cache != NULL)
+		return 0;
+
+	const OUFS_GEOMETRY *g = oufs_geometry();
+	inode_cache = calloc(g->n_inode_blocks, sizeof(INODE *));
+	inode_cache_dirty = calloc(g->n_inode_blocks, 1);
+	if (inode_cache == NULL || inode_cache_dirty == NULL) {
+		free(inode_cache);
+		free(inode_cache_dirty);
+		inode_cache = NULL;
+		inode_cache_dirty = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Decode an inode block into the resident inode table
+ *
+ * @param block Inode block (0 is the first block of the inode table)
+ * @param b The block as read from the disk
+ * @return 0 if successful, -1 if out of memory
+ */
+static int oufs_inode_cache_fill(int block, const BLOCK *b)
+{
+	const OUFS_GEOMETRY *g = oufs_geometry();
+	INODE *inodes = malloc(g->inodes_per_block * sizeof(INODE));
+	if (inodes == NULL)
+		return -1;
+	for (int j = 0; j < g->inodes_per_block; j++)
+		oufs_decode_inode(b->data.data + j * g->inode_size, &inodes[j]);
+	inode_cache[block] = inodes;
+	return 0;
+}
+
+/**
+ * Find an inode in the resident inode table, reading its inode block if it
+ * is not there yet
+ *
+ * @param i Inode reference
+ * @return The resident inode, or NULL if it can't be read
+ */
+static INODE *oufs_cached_inode(INODE_REFERENCE i)
+{
+	const OUFS_GEOMETRY *g = oufs_geometry();
+	if (i >= (INODE_REFERENCE) g->n_inodes) {
+		fprintf(stderr, "Error: bad inode reference %u\n", i);
+		return NULL;
+	}
+	if (oufs_inode_cache_init() != 0)
+		return NULL;
+
+	// Find the inode block and the inode within the block
+	int block = i / g->inodes_per_block;
+	int element = i % g->inodes_per_block;
+
+	if (inode_cache[block] == NULL) {
+		BLOCK b;
+		if (vdisk_read_block(g->inode_table_block + block, &b) != 0 || oufs_inode_cache_fill(block, &b) != 0)
+			return NULL;
+	}
+	return &inode_cache[block][element];
+}
+
+/**
+ * Bring the inode blocks holding a set of inodes into the resident inode
+ * table, reading the missing ones in inode-block order, OUFS_IO_BATCH
+ * blocks per vectored read
+ *
+ * @param refs The inodes (bad references are skipped)
+ * @param n Number of inodes
+ * @return 0 if successful, -1 on error
+ */
+int oufs_prefetch_inodes(const INODE_REFERENCE *refs, int n)
+{
+	const OUFS_GEOMETRY *g = oufs_geometry();
+	if (oufs_inode_cache_init() != 0)
+		return -1;
+
+	unsigned char *wanted = calloc(g->n_inode_blocks, 1);
+	BLOCK *buffers = malloc(OUFS_IO_BATCH * sizeof(BLOCK));
+	if (wanted == NULL || buffers == NULL) {
+		free(wanted);
+		free(buffers);
+		return -1;
+	}
+	for (int i = 0; i < n; i++) {
+		if (refs[i] < (INODE_REFERENCE) g->n_inodes)
+			wanted[refs[i] / g->inodes_per_block] = 1;
+	}
+
+	int ret = 0;
+	BLOCK_REFERENCE block_refs[OUFS_IO_BATCH];
+	void *blocks[OUFS_IO_BATCH];
+	int blocks_of[OUFS_IO_BATCH];
+	int n_batch = 0;
+	for (int block = 0; block <= g->n_inode_blocks && ret == 0; block++) {
+		if (block < g->n_inode_blocks && (!wanted[block] || inode_cache[block] != NULL))
+			continue;
+		if (n_batch == OUFS_IO_BATCH || (block == g->n_inode_blocks && n_batch > 0)) {
+			if (vdisk_read_blocks(block_refs, blocks, n_batch) != 0)
+				ret = -1;
+			for (int j = 0; j < n_batch && ret == 0; j++)
+				ret = oufs_inode_cache_fill(blocks_of[j], &buffers[j]);
+			n_batch = 0;
+		}
+		if (block < g->n_inode_blocks) {
+			block_refs[n_batch] = g->inode_table_block + block;
+			blocks[n_batch] = &buffers[n_batch];
+			blocks_of[n_batch] = block;
+			n_batch++;
+		}
+	}
+
+	free(wanted);
+	free(buffers);
+	return ret;
+}
+
+/**
+ *  Given an inode reference, read the inode from the virtual disk.
+ *
+ *  @param i Inode reference (index into the inode list)
+ *  @param inode Pointer to an inode memory structure.  This structure will be
+ *                filled in before return)
+ *  @return 0 = successfully loaded the inode
+ *         -1 = an error has occurred
+ *
+ */
+int oufs_read_inode_by_reference(INODE_REFERENCE i, INODE *inode)
+{
+	if(debug)
+		fprintf(stderr, "##Fetching inode %d\n", i);
+
+	INODE *cached = oufs_cached_inode(i);
+	if (cached == NULL)
+		return(-1);
+	*inode = *cached;
+	return(0);
+}
+
+/**
+ *  Given an inode reference, write the inode to the virtual disk.
+ *
+ *  @param i Inode reference (index into the inode list)
+ *  @param inode Pointer to an inode memory structure.  This structure will be
+ *                filled written to the disk)
+ *  @return 0 = successfully loaded the inode
+ *         -1 = an error has occurred
+ *
+ */
+int oufs_write_inode_by_reference(INODE_REFERENCE i, INODE *inode)
+{
+	if(debug)
+		fprintf(stderr, "##Writing to inode %d\n", i);
+
+	INODE *cached = oufs_cached_inode(i);
+	if (cached == NULL)
+		return(-1);
+
+	// The inode block is written back by oufs_flush()
+	*cached = *inode;
+	inode_cache_dirty[i / geometry.inodes_per_block] = 1;
+	inodes_dirty = 1;
+	return(0);
+}
+
+/**
+ *  Given an unsigned char (1 byte), return the index of the first 0 bit
+ *
+ *  @param value Byte to find open bit in
+ *
+ *  @return Index 0-7 indicating open bytes
+Return -1 on error
+ *
+ */
+int oufs_find_open_bit(unsigned char value)
+{
+	//xxxx xxxx
+	if (value == 0xff) {
+		fprintf(stderr, "Error: oufs_find_open_bit() failed\n");
+		return -1; //All bits are 1
+	}
+
+	return __builtin_ctz(~value); //Lowest 0 bit
+}
+
+/**
+ * Hash of a working directory string, as saved in ZPWD_INODE
+ *
+ * @param cwd Working directory
+ * @return FNV-1a hash of the string
+ */
+static unsigned int oufs_path_hash(const char *cwd)
+{
+	unsigned int hash = 2166136261u;
+	for (; *cwd != '\0'; cwd++) {
+		hash ^= (unsigned char) *cwd;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/**
+ * Take the working directory from ZPWD_INODE, if it was saved for this
+ * working directory and this generation of the file system
+ *
+ * @param cwd Working directory
+ * @param parent Set to the inode of the directory that holds it
+ * @param child Set to its inode
+ * @return 1 if ZPWD_INODE could be used, 0 if not
+ */
+static int oufs_cwd_from_environment(const char *cwd, INODE_REFERENCE *parent, INODE_REFERENCE *child)
+{
+	char *str = getenv("ZPWD_INODE");
+	unsigned int saved_child, saved_parent, saved_generation, saved_hash, generation;
+	if (str == NULL ||
+	    sscanf(str, "%u:%u:%u:%x", &saved_child, &saved_parent, &saved_generation, &saved_hash) != 4)
+		return 0;
+	if (oufs_generation(&generation) != 0 || generation != saved_generation ||
+	    oufs_path_hash(cwd) != saved_hash || saved_child >= (unsigned int) N_INODES)
+		return 0;
+
+	INODE inode;
+	if (oufs_read_inode_by_reference(saved_child, &inode) != 0 || inode.type != IT_DIRECTORY)
+		return 0;
+
+	//Its .. entry must still name the saved parent (the root has none)
+	if (saved_child != 0 && oufs_find_entry(&inode, "..", 2) != saved_parent)
+		return 0;
+
+	*parent = saved_parent;
+	*child = saved_child;
+	return 1;
+}
+
+/**
+ * Resolve the working directory.  The result is kept for the rest of the
+ * process, and can be handed to later processes through ZPWD_INODE (see
+ * oufs_cwd_cookie()) so that they skip the walk down the path
+ *
+ * @param cwd Working directory (an absolute path)
+ * @param parent Set to the inode of the directory that holds it
+ * @param child Set to its inode (UNALLOCATED_INODE if it does not exist,
+ *              or on failure)
+ * @param local_name Set to its name
+ * @return 0 if successful, -1 if the path crosses a file
+ */
+static int oufs_find_cwd(const char *cwd, INODE_REFERENCE *parent, INODE_REFERENCE *child, char *local_name)
+{
+	if (!cwd_cache_valid || strcmp(cwd, cwd_cache_path) != 0) {
+		cwd_cache_valid = 0;
+		if (strlen(cwd) >= MAX_PATH_LENGTH) {
+			if (oufs_find_file(cwd, cwd, parent, child, local_name) != 0) {
+				*parent = *child = UNALLOCATED_INODE;
+				local_name[0] = '\0';
+				return -1;
+			}
+			return 0;
+		}
+
+		if (oufs_cwd_from_environment(cwd, &cwd_cache_parent, &cwd_cache_child)) {
+			//Name: the last component of the path
+			OUFS_PATH_ITER it;
+			const char *name = "/";
+			int length = 1;
+			oufs_path_begin(&it, cwd);
+			while (oufs_path_next(&it, &name, &length))
+				;
+			length = MIN(length, FILE_NAME_SIZE - 1);
+			memcpy(cwd_cache_name, name, length);
+			cwd_cache_name[length] = '\0';
+		}
+		else if (oufs_find_file(cwd, cwd, &cwd_cache_parent, &cwd_cache_child, cwd_cache_name) != 0) {
+			*parent = *child = UNALLOCATED_INODE;
+			local_name[0] = '\0';
+			return -1;
+		}
+		strcpy(cwd_cache_path, cwd);
+
+		//A directory that does not exist yet may be made later on
+		cwd_cache_valid = cwd_cache_child != UNALLOCATED_INODE;
+	}
+
+	*parent = cwd_cache_parent;
+	*child = cwd_cache_child;
+	strcpy(local_name, cwd_cache_name);
+	return 0;
+}
+
+/**
+ * Build the value of ZPWD_INODE for a working directory: its inode, the
+ * inode of the directory that holds it, the file system generation and a
+ * hash of the path, as "inode:parent:generation:hash"
+ *
+ * @param cwd Working directory
+ * @param cookie Filled in with the value
+ * @param size Size of cookie
+ * @return 0 if successful, -1 if cwd is not a directory or the disk has no
+ *         superblock to keep a generation in
+ */
+int oufs_cwd_cookie(const char *cwd, char *cookie, int size)
+{
+	INODE_REFERENCE parent, child;
+	char local_name[FILE_NAME_SIZE];
+	unsigned int generation;
+	if (oufs_find_cwd(cwd, &parent, &child, local_name) != 0 || child == UNALLOCATED_INODE ||
+	    oufs_generation(&generation) != 0)
+		return -1;
+
+	INODE inode;
+	if (oufs_read_inode_by_reference(child, &inode) != 0 || inode.type != IT_DIRECTORY)
+		return -1;
+
+	snprintf(cookie, size, "%u:%u:%u:%08x", child, parent, generation, oufs_path_hash(cwd));
+	return 0;
+}
+
+/**
+ * Directory scan kernels: find the entry of a directory block whose name
+ * matches, comparing the 16 bytes at the start of each entry (the name,
+ * then the reserved field) with the name padded with zeros.  Only the
+ * first length + 1 bytes decide, so bytes after a name's terminator
+ * don't matter.  A length of 0 looks for a free entry.  Each kernel comes
+ * with a check for blocks of zeros, used to keep holes in sparse files
+ */
+
+/**
+ * Scan kernel without vector instructions
+ */
+static int oufs_scan_scalar(const DIRECTORY_ENTRY *entries, int n, const char *key, int length)
+{
+	for (int i = 0; i < n; i++) {
+		if (memcmp(entries[i].name, key, length + 1) == 0)
+			return i;
+	}
+	return -1;
+}
+
+/**
+ * Zero check without vector instructions: 8 bytes at a time
+ */
+static int oufs_zero_scalar(const unsigned char *data, int length)
+{
+	unsigned long long bits = 0;
+	for (int i = 0; i < length; i += sizeof(bits)) {
+		unsigned long long word;
+		memcpy(&word, data + i, sizeof(word));
+		bits |= word;
+	}
+	return bits == 0;
+}
+
+#ifdef OUFS_HAVE_X86_SCAN
+/**
+ * Zero check with SSE2: 64 bytes at a time
+ */
+__attribute__((target("sse2")))
+static int oufs_zero_sse2(const unsigned char *data, int length)
+{
+	__m128i bits = _mm_setzero_si128();
+	for (int i = 0; i < length; i += 64) {
+		__m128i v0 = _mm_or_si128(_mm_loadu_si128((const __m128i *) (data + i)),
+					  _mm_loadu_si128((const __m128i *) (data + i + 16)));
+		__m128i v1 = _mm_or_si128(_mm_loadu_si128((const __m128i *) (data + i + 32)),
+					  _mm_loadu_si128((const __m128i *) (data + i + 48)));
+		bits = _mm_or_si128(bits, _mm_or_si128(v0, v1));
+	}
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(bits, _mm_setzero_si128())) == 0xffff;
+}
+
+/**
+ * Scan kernel comparing an entry at a time with SSE2
+ */
+__attribute__((target("sse2")))
+static int oufs_scan_sse2(const DIRECTORY_ENTRY *entries, int n, const char *key, int length)
+{
+	const unsigned int mask = (1u << (length + 1)) - 1;
+	const __m128i k = _mm_loadu_si128((const __m128i *) key);
+	int i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		unsigned int m0 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) &entries[i]), k));
+		unsigned int m1 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) &entries[i + 1]), k));
+		unsigned int m2 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) &entries[i + 2]), k));
+		unsigned int m3 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) &entries[i + 3]), k));
+		if ((m0 & mask) == mask)
+			return i;
+		if ((m1 & mask) == mask)
+			return i + 1;
+		if ((m2 & mask) == mask)
+			return i + 2;
+		if ((m3 & mask) == mask)
+			return i + 3;
+	}
+	for (; i < n; i++) {
+		unsigned int m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) &entries[i]), k));
+		if ((m & mask) == mask)
+			return i;
+	}
+	return -1;
+}
+
+static int oufs_have_sse2(void)
+{
+	return __builtin_cpu_supports("sse2");
+}
+#endif
+
+// Built-in scan kernels, fastest first
+static const OUFS_SCAN_KERNEL scan_kernels[] = {
+#ifdef OUFS_HAVE_X86_SCAN
+	{"sse2", oufs_have_sse2, oufs_scan_sse2, oufs_zero_sse2},
+#endif
+	{"scalar", NULL, oufs_scan_scalar, oufs_zero_scalar},
+};
+#define N_SCAN_KERNELS ((int) (sizeof(scan_kernels) / sizeof(scan_kernels[0])))
+
+/**
+ * Choose the directory scan kernel
+ *
+ * @param name Kernel name ("sse2" or "scalar"), or NULL for the
+ *             fastest one that the processor supports
+ * @return 0 if successful, -1 if there is no such kernel or the processor
+ *         doesn't support it
+ */
+int oufs_select_scan_kernel(const char *name)
+{
+	for (int i = 0; i < N_SCAN_KERNELS; i++) {
+		const OUFS_SCAN_KERNEL *kernel = &scan_kernels[i];
+		if (name != NULL && strcmp(kernel->name, name) != 0)
+			continue;
+		if (kernel->supported != NULL && !kernel->supported()) {
+			if (name != NULL)
+				return -1;
+			continue;
+		}
+		scan_kernel = kernel;
+		return 0;
+	}
+	return -1;
+}
+
+/**
+ * The directory scan kernel in use.  The first call picks it: the one
+ * named by the ZSCAN environment variable, or else the fastest one
+ *
+ * @return The kernel
+ */
+const OUFS_SCAN_KERNEL *oufs_scan_kernel(void)
+{
+	if (scan_kernel == NULL) {
+		char *name = getenv("ZSCAN");
+		if (name != NULL && oufs_select_scan_kernel(name) != 0)
+			fprintf(stderr, "Unknown or unsupported scan kernel (%s)\n", name);
+		if (scan_kernel == NULL)
+			oufs_select_scan_kernel(NULL);
+	}
+	return scan_kernel;
+}
+
+/**
+ * Check whether a block holds nothing but zeros
+ *
+ * @param data The block
+ * @param length Its length (a multiple of 256 bytes, as BLOCK_SIZE is)
+ * @return 1 if every byte is 0, 0 otherwise
+ */
+int oufs_block_is_zero(const unsigned char *data, int length)
+{
+	return oufs_scan_kernel()->is_zero(data, length);
+}
+
+/**
+ * Find an entry of a directory block by name
+ *
+ * @param entries The entries
+ * @param n Number of entries
+ * @param name Name to look for (need not be terminated), or NULL for a
+ *             free entry
+ * @param length Length of the name
+ * @return Index of the first matching entry, or -1 if there is none
+ */
+int oufs_directory_scan(const DIRECTORY_ENTRY *entries, int n, const char *name, int length)
+{
+	char key[FILE_NAME_SIZE + sizeof(unsigned short)];
+	if (length < 0 || length >= FILE_NAME_SIZE)
+		return -1;
+
+	memset(key, 0, sizeof(key));
+	if (name != NULL)
+		memcpy(key, name, length);
+	else
+		length = 0;
+	return oufs_scan_kernel()->scan(entries, n, key, length);
+}
+
+/**
+ * Free-slot hint for a directory: blocks before it are known to be full
+ *
+ * @param dir Directory inode
+ * @return The hint slot
+ */
+static OUFS_DIRECTORY_HINT *oufs_directory_hint(INODE_REFERENCE dir)
+{
+	OUFS_DIRECTORY_HINT *hint = &directory_hints[dir % N_DIRECTORY_HINTS];
+	if (hint->dir != dir) {
+		hint->dir = dir;
+		hint->block = 0;
+	}
+	return hint;
+}
+
+/**
+ * Count the blocks of a directory (they are always file blocks 0 to n-1)
+ *
+ * @param map Walk over the directory's block map
+ * @return Number of blocks
+ */
+static int oufs_directory_n_blocks(OUFS_BMAP *map)
+{
+	int n = 0;
+	BLOCK_REFERENCE block_ref;
+	while (oufs_bmap(map, n, 1, &block_ref, 0) == 1 && block_ref != UNALLOCATED_BLOCK)
+		n++;
+	return n;
+}
+
+/**
+ * Read a block of a directory as directory entries
+ *
+ * @param map Walk over the directory's block map
+ * @param file_block Block of the directory
+ * @param block Filled in with the entries
+ * @return 0 if successful, -1 if the directory has no such block
+ */
+static int oufs_directory_read(OUFS_BMAP *map, unsigned int file_block, BLOCK *block)
+{
+	BLOCK_REFERENCE block_ref;
+	if (oufs_bmap(map, file_block, 1, &block_ref, 0) != 1 || block_ref == UNALLOCATED_BLOCK)
+		return -1;
+	return oufs_read_directory_block(block_ref, block);
+}
+
+/**
+ * Write a block of a directory as directory entries
+ *
+ * @param map Walk over the directory's block map
+ * @param file_block Block of the directory
+ * @param block The entries
+ * @return 0 if successful, -1 if the directory has no such block
+ */
+static int oufs_directory_write(OUFS_BMAP *map, unsigned int file_block, BLOCK *block)
+{
+	BLOCK_REFERENCE block_ref;
+	if (oufs_bmap(map, file_block, 1, &block_ref, 0) != 1 || block_ref == UNALLOCATED_BLOCK)
+		return -1;
+	return oufs_write_directory_block(block_ref, block);
+}
+
+/**
+ * Add a block to the end of a directory
+ *
+ * @param map Walk over the directory's block map
+ * @param n_blocks Number of blocks of the directory; counts the new one
+ * @param file_block Set to the new block of the directory
+ * @return 0 if successful, -1 if the directory can't grow
+ */
+static int oufs_directory_grow(OUFS_BMAP *map, int *n_blocks, unsigned int *file_block)
+{
+	BLOCK_REFERENCE block_ref;
+	if (oufs_bmap(map, *n_blocks, 1, &block_ref, 1) != 1)
+		return -1;
+	*file_block = (*n_blocks)++;
+	return 0;
+}
+
+/**
+ * Hash of a name for the directory index
+ *
+ * @param name The name (need not be terminated)
+ * @param length Length of the name
+ * @return The hash (FNV-1a)
+ */
+static unsigned int oufs_dx_hash(const char *name, int length)
+{
+	unsigned int hash = 2166136261u;
+	for (int i = 0; i < length; i++) {
+		hash ^= (unsigned char) name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/**
+ * Order directory entries by the hash of their names (for qsort())
+ */
+static int oufs_dx_entry_cmp(const void *entry_ref_1, const void *entry_ref_2)
+{
+	const char *name_1 = ((const DIRECTORY_ENTRY *) entry_ref_1)->name;
+	const char *name_2 = ((const DIRECTORY_ENTRY *) entry_ref_2)->name;
+	unsigned int hash_1 = oufs_dx_hash(name_1, strlen(name_1));
+	unsigned int hash_2 = oufs_dx_hash(name_2, strlen(name_2));
+	return hash_1 < hash_2 ? -1 : hash_1 > hash_2;
+}
+
+/**
+ * Hash of the name of a directory entry
+ */
+static unsigned int oufs_dx_entry_hash(const DIRECTORY_ENTRY *entry)
+{
+	return oufs_dx_hash(entry->name, strlen(entry->name));
+}
+
+/**
+ * Read an index node
+ *
+ * @param map Walk over the directory's block map
+ * @param file_block Block of the directory holding the node
+ * @param node Filled in with the node
+ * @return 0 if successful, -1 on error
+ */
+static int oufs_dx_read(OUFS_BMAP *map, unsigned int file_block, OUFS_DX_NODE *node)
+{
+	BLOCK_REFERENCE block_ref;
+	if (oufs_bmap(map, file_block, 1, &block_ref, 0) != 1 || block_ref == UNALLOCATED_BLOCK ||
+	    vdisk_read_block(block_ref, node) != 0)
+		return -1;
+	if (node->count == 0 || node->count > (unsigned int) DX_ENTRIES_PER_NODE || node->level >= DX_MAX_DEPTH) {
+		fprintf(stderr, "Error: bad directory index node\n");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Write an index node
+ *
+ * @param map Walk over the directory's block map
+ * @param file_block Block of the directory holding the node
+ * @param node The node
+ * @return 0 if successful, -1 on error
+ */
+static int oufs_dx_write(OUFS_BMAP *map, unsigned int file_block, OUFS_DX_NODE *node)
+{
+	BLOCK_REFERENCE block_ref;
+	if (oufs_bmap(map, file_block, 1, &block_ref, 0) != 1 || block_ref == UNALLOCATED_BLOCK)
+		return -1;
+	return vdisk_write_block(block_ref, node);
+}
+
+/**
+ * Find the child of an index node that covers a hash
+ *
+ * @param node The node
+ * @param hash The hash
+ * @return Index of the last entry whose hash is not above hash
+ */
+static int oufs_dx_find_slot(const OUFS_DX_NODE *node, unsigned int hash)
+{
+	int low = 1;
+	int high = node->count - 1;
+	while (low <= high) {
+		int mid = (low + high) / 2;
+		if (node->entry[mid].hash <= hash)
+			low = mid + 1;
+		else
+			high = mid - 1;
+	}
+	return low - 1;
+}
+
+/**
+ * Find the root of a directory's index
+ *
+ * @param block0 Block 0 of the directory
+ * @return The block of the directory holding the root node, or 0 if the
+ *         directory is not indexed
+ */
+static unsigned int oufs_dx_root(const BLOCK *block0)
+{
+	const DIRECTORY_ENTRY *entry = &block0->directory.entry[2];
+	if (DIRECTORY_ENTRIES_PER_BLOCK > 2 && strcmp(entry->name, DIRECTORY_INDEX_NAME) == 0)
+		return entry->inode_reference;
+	return 0;
+}
+
+/**
+ * Walk down a directory's index to the leaf that covers a hash
+ *
+ * @param map Walk over the directory's block map
+ * @param root Block of the directory holding the root node
+ * @param hash The hash
+ * @param nodes Filled in with the index nodes on the way (if not NULL)
+ * @param node_blocks Filled in with the blocks of those nodes
+ * @param slots Filled in with the entry followed in each node
+ * @param depth Set to the number of index nodes on the way
+ * @return The block of the directory holding the leaf, or 0 on error
+ */
+static unsigned int oufs_dx_walk(OUFS_BMAP *map, unsigned int root, unsigned int hash, OUFS_DX_NODE *nodes,
+				 unsigned int *node_blocks, int *slots, int *depth)
+{
+	OUFS_DX_NODE node;
+	unsigned int file_block = root;
+	for (int d = 0; d < DX_MAX_DEPTH; d++) {
+		OUFS_DX_NODE *n = nodes != NULL ? &nodes[d] : &node;
+		if (oufs_dx_read(map, file_block, n) != 0)
+			return 0;
+		int slot = oufs_dx_find_slot(n, hash);
+		if (nodes != NULL) {
+			node_blocks[d] = file_block;
+			slots[d] = slot;
+			*depth = d + 1;
+		}
+		file_block = n->entry[slot].block;
+		if (n->level == 0)
+			return file_block;
+	}
+	return 0;
+}
+
+/**
+ * Look a name up in an indexed directory
+ *
+ * @return The entry's inode, or UNALLOCATED_INODE if there is none
+ */
+static INODE_REFERENCE oufs_dx_lookup(OUFS_BMAP *map, unsigned int root, const char *name, int length)
+{
+	unsigned int leaf = oufs_dx_walk(map, root, oufs_dx_hash(name, length), NULL, NULL, NULL, NULL);
+	BLOCK block;
+	if (leaf == 0 || oufs_directory_read(map, leaf, &block) != 0)
+		return UNALLOCATED_INODE;
+
+	int i = oufs_directory_scan(block.directory.entry, DIRECTORY_ENTRIES_PER_BLOCK, name, length);
+	return i >= 0 ? block.directory.entry[i].inode_reference : UNALLOCATED_INODE;
+}
+
+/**
+ * Split a full index node while adding an entry to it: the upper half of
+ * the entries moves to a new node
+ *
+ * @param map Walk over the directory's block map
+ * @param n_blocks Number of blocks of the directory
+ * @param node The node
+ * @param node_block Its block
+ * @param pos Where the new entry goes
+ * @param pending The new entry
+ * @param up Set to the entry for the new node, to add to the parent
+ * @return 0 if successful, -1 if the directory can't grow
+ */
+static int oufs_dx_split_node(OUFS_BMAP *map, int *n_blocks, OUFS_DX_NODE *node, unsigned int node_block,
+			      int pos, OUFS_DX_ENTRY pending, OUFS_DX_ENTRY *up)
+{
+	int n = node->count + 1;
+	OUFS_DX_ENTRY all[n];
+	memcpy(all, node->entry, pos * sizeof(OUFS_DX_ENTRY));
+	all[pos] = pending;
+	memcpy(&all[pos + 1], &node->entry[pos], (node->count - pos) * sizeof(OUFS_DX_ENTRY));
+
+	unsigned int new_block;
+	if (oufs_directory_grow(map, n_blocks, &new_block) != 0)
+		return -1;
+
+	int m = n / 2;
+	OUFS_DX_NODE right;
+	memset(&right, 0, sizeof(right));
+	right.level = node->level;
+	right.count = n - m;
+	memcpy(right.entry, &all[m], (n - m) * sizeof(OUFS_DX_ENTRY));
+	node->count = m;
+	memcpy(node->entry, all, m * sizeof(OUFS_DX_ENTRY));
+	memset(&node->entry[m], 0, (DX_ENTRIES_PER_NODE - m) * sizeof(OUFS_DX_ENTRY));
+
+	up->hash = all[m].hash;
+	up->block = new_block;
+	if (oufs_dx_write(map, node_block, node) != 0 || oufs_dx_write(map, new_block, &right) != 0)
+		return -1;
+	return 0;
+}
+
+/**
+ * Add an entry to an indexed directory.  A full leaf is split in two by
+ * hash, and full index nodes above it in turn
+ *
+ * @return 0 if successful, -1 if the directory can't grow
+ */
+static int oufs_dx_add(OUFS_BMAP *map, int *n_blocks, unsigned int root, const char *name, INODE_REFERENCE child)
+{
+	OUFS_DX_NODE nodes[DX_MAX_DEPTH];
+	unsigned int node_blocks[DX_MAX_DEPTH];
+	int slots[DX_MAX_DEPTH];
+	int depth = 0;
+	unsigned int hash = oufs_dx_hash(name, strlen(name));
+	unsigned int leaf = oufs_dx_walk(map, root, hash, nodes, node_blocks, slots, &depth);
+
+	BLOCK block;
+	if (leaf == 0 || oufs_directory_read(map, leaf, &block) != 0)
+		return -1;
+
+	int per = DIRECTORY_ENTRIES_PER_BLOCK;
+	int slot = oufs_directory_scan(block.directory.entry, per, NULL, 0);
+	if (slot >= 0) {
+		strcpy(block.directory.entry[slot].name, name);
+		block.directory.entry[slot].inode_reference = child;
+		return oufs_directory_write(map, leaf, &block);
+	}
+
+	//Full leaf: sort its entries and the new one by hash and split them,
+	//never between two entries with the same hash
+	DIRECTORY_ENTRY all[per + 1];
+	memcpy(all, block.directory.entry, per * sizeof(DIRECTORY_ENTRY));
+	oufs_clean_directory_entry(&all[per]);
+	strcpy(all[per].name, name);
+	all[per].inode_reference = child;
+	qsort(all, per + 1, sizeof(DIRECTORY_ENTRY), oufs_dx_entry_cmp);
+
+	int m = (per + 1) / 2;
+	while (m <= per && oufs_dx_entry_hash(&all[m]) == oufs_dx_entry_hash(&all[m - 1]))
+		m++;
+	if (m > per) {
+		m = (per + 1) / 2;
+		while (m > 0 && oufs_dx_entry_hash(&all[m]) == oufs_dx_entry_hash(&all[m - 1]))
+			m--;
+		if (m == 0)
+			return -1; //Every name has the same hash
+	}
+
+	unsigned int new_leaf;
+	if (oufs_directory_grow(map, n_blocks, &new_leaf) != 0)
+		return -1;
+	BLOCK right;
+	for (int i = 0; i < per; i++) {
+		oufs_clean_directory_entry(&block.directory.entry[i]);
+		oufs_clean_directory_entry(&right.directory.entry[i]);
+	}
+	memcpy(block.directory.entry, all, m * sizeof(DIRECTORY_ENTRY));
+	memcpy(right.directory.entry, &all[m], (per + 1 - m) * sizeof(DIRECTORY_ENTRY));
+	if (oufs_directory_write(map, leaf, &block) != 0 || oufs_directory_write(map, new_leaf, &right) != 0)
+		return -1;
+
+	//Add the new leaf to the index, splitting nodes on the way up
+	OUFS_DX_ENTRY pending = {oufs_dx_entry_hash(&all[m]), new_leaf};
+	for (int d = depth - 1; d >= 0; d--) {
+		OUFS_DX_NODE *node = &nodes[d];
+		int pos = slots[d] + 1;
+		if (node->count < (unsigned int) DX_ENTRIES_PER_NODE) {
+			memmove(&node->entry[pos + 1], &node->entry[pos], (node->count - pos) * sizeof(OUFS_DX_ENTRY));
+			node->entry[pos] = pending;
+			node->count++;
+			return oufs_dx_write(map, node_blocks[d], node);
+		}
+
+		if (d > 0) {
+			if (oufs_dx_split_node(map, n_blocks, node, node_blocks[d], pos, pending, &pending) != 0)
+				return -1;
+			continue;
+		}
+
+		//Full root: move its entries to a new node below it and split that
+		if (node->level + 1 >= DX_MAX_DEPTH)
+			return -1;
+		unsigned int moved;
+		if (oufs_directory_grow(map, n_blocks, &moved) != 0)
+			return -1;
+		OUFS_DX_NODE below = *node;
+		OUFS_DX_ENTRY up;
+		if (oufs_dx_split_node(map, n_blocks, &below, moved, pos, pending, &up) != 0)
+			return -1;
+		memset(node, 0, sizeof(*node));
+		node->level = below.level + 1;
+		node->count = 2;
+		node->entry[0].hash = 0;
+		node->entry[0].block = moved;
+		node->entry[1] = up;
+		return oufs_dx_write(map, node_blocks[0], node);
+	}
+	return -1;
+}
+
+/**
+ * Remove an entry from an indexed directory.  Leaves are never merged
+ *
+ * @return The entry's inode, or UNALLOCATED_INODE if there is none
+ */
+static INODE_REFERENCE oufs_dx_remove(OUFS_BMAP *map, unsigned int root, const char *name)
+{
+	unsigned int leaf = oufs_dx_walk(map, root, oufs_dx_hash(name, strlen(name)), NULL, NULL, NULL, NULL);
+	BLOCK block;
+	if (leaf == 0 || oufs_directory_read(map, leaf, &block) != 0)
+		return UNALLOCATED_INODE;
+
+	int i = oufs_directory_scan(block.directory.entry, DIRECTORY_ENTRIES_PER_BLOCK, name, strlen(name));
+	if (i < 0)
+		return UNALLOCATED_INODE;
+	INODE_REFERENCE child = block.directory.entry[i].inode_reference;
+	oufs_clean_directory_entry(&block.directory.entry[i]);
+	oufs_directory_write(map, leaf, &block);
+	return child;
+}
+
+/**
+ * Gather the entries of the leaves below an index node
+ *
+ * @param map Walk over the directory's block map
+ * @param file_block Block of the directory holding the node
+ * @param entries Array to add the entries to
+ * @param n Number of entries in the array
+ * @param max Room in the array
+ */
+static void oufs_dx_collect(OUFS_BMAP *map, unsigned int file_block, DIRECTORY_ENTRY *entries, int *n, int max)
+{
+	OUFS_DX_NODE node;
+	if (oufs_dx_read(map, file_block, &node) != 0)
+		return;
+
+	for (unsigned int e = 0; e < node.count; e++) {
+		if (node.level > 0) {
+			oufs_dx_collect(map, node.entry[e].block, entries, n, max);
+			continue;
+		}
+		BLOCK block;
+		if (oufs_directory_read(map, node.entry[e].block, &block) != 0)
+			continue;
+		for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK && *n < max; i++) {
+			if (block.directory.entry[i].inode_reference != UNALLOCATED_INODE)
+				entries[(*n)++] = block.directory.entry[i];
+		}
+	}
+}
 
-	//Initialize all other inodes to unallocated inodes
+/**
+ * Turn a linear directory into an indexed one: block 0 keeps "." and ".."
+ * and points to a root index node in block 1, and the other entries are
+ * spread over leaves by hash, each left with room to grow
+ *
+ * @param map Walk over the directory's block map
+ * @param n_blocks Number of blocks of the directory
+ * @param block0 Block 0 of the directory
+ * @return 0 if successful, -1 if the directory stays linear
+ */
+static int oufs_dx_convert(OUFS_BMAP *map, int *n_blocks, BLOCK *block0)
+{
+	int per = DIRECTORY_ENTRIES_PER_BLOCK;
+	if (per < 4)
+		return -1;
 
-	oufs_clean_inode(&inode);
-	for (i = 1; i < N_INODES; i++)
-	{
-		oufs_write_inode_by_reference(i, &inode);
+	//The entries other than "." and ".."
+	DIRECTORY_ENTRY *entries = malloc((size_t) *n_blocks * per * sizeof(DIRECTORY_ENTRY));
+	if (entries == NULL)
+		return -1;
+	int n = 0;
+	BLOCK block;
+	for (int b = 0; b < *n_blocks; b++) {
+		if (oufs_directory_read(map, b, &block) != 0) {
+			free(entries);
+			return -1;
+		}
+		for (int i = b == 0 ? 2 : 0; i < per; i++) {
+			if (block.directory.entry[i].inode_reference != UNALLOCATED_INODE)
+				entries[n++] = block.directory.entry[i];
+		}
+	}
+	qsort(entries, n, sizeof(DIRECTORY_ENTRY), oufs_dx_entry_cmp);
+
+	//Leaves three quarters full, starting at block 2
+	OUFS_DX_NODE root;
+	memset(&root, 0, sizeof(root));
+	int fill = MAX(1, per * 3 / 4);
+	int first = 0;
+	while (first < n || root.count == 0) {
+		int last = MIN(first + fill, n);
+		while (last < n && last > first && oufs_dx_entry_hash(&entries[last]) == oufs_dx_entry_hash(&entries[last - 1]))
+			last++;
+		if (last - first > per || root.count == (unsigned int) DX_ENTRIES_PER_NODE) {
+			free(entries);
+			return -1;
+		}
+		root.entry[root.count].hash = root.count == 0 ? 0 : oufs_dx_entry_hash(&entries[first]);
+		root.entry[root.count].block = 2 + root.count;
+		root.count++;
+		first = last;
 	}
 
+	//Make sure that the directory has the blocks
+	unsigned int file_block;
+	while ((unsigned int) *n_blocks < 2 + root.count) {
+		if (oufs_directory_grow(map, n_blocks, &file_block) != 0) {
+			free(entries);
+			return -1;
+		}
+	}
 
-	//Initialize root directory block with . and ..
-	//Use oufs_clean_directory_block()
-
-	oufs_clean_directory_block(0, 0, &block);
-	vdisk_write_block(ROOT_DIRECTORY_BLOCK, &block); //Initialize the root directory
+	//Write the leaves, the root and, only once they are all on disk, block 0
+	first = 0;
+	for (unsigned int e = 0; e < root.count; e++) {
+		int last = e + 1 < root.count ? first : n;
+		while (last < n && (e + 1 == root.count || oufs_dx_entry_hash(&entries[last]) < root.entry[e + 1].hash))
+			last++;
+		for (int i = 0; i < per; i++)
+			oufs_clean_directory_entry(&block.directory.entry[i]);
+		memcpy(block.directory.entry, &entries[first], (last - first) * sizeof(DIRECTORY_ENTRY));
+		if (oufs_directory_write(map, root.entry[e].block, &block) != 0) {
+			free(entries);
+			return -1;
+		}
+		first = last;
+	}
+	free(entries);
+	if (oufs_dx_write(map, 1, &root) != 0)
+		return -1;
 
-	return 0;
+	for (int i = 2; i < per; i++)
+		oufs_clean_directory_entry(&block0->directory.entry[i]);
+	strcpy(block0->directory.entry[2].name, DIRECTORY_INDEX_NAME);
+	block0->directory.entry[2].inode_reference = 1;
+	return oufs_directory_write(map, 0, block0);
 }
 
 /**
- *  Given an inode reference, read the inode from the virtual disk.
- *
- *  @param i Inode reference (index into the inode list)
- *  @param inode Pointer to an inode memory structure.  This structure will be
- *                filled in before return)
- *  @return 0 = successfully loaded the inode
- *         -1 = an error has occurred
+ * Add an entry to a directory, in the first free slot, growing the
+ * directory by a block if it is full.  A linear directory that grows past
+ * DIRECTORY_INDEX_THRESHOLD blocks is indexed, if the disk allows it
  *
+ * @param dir Directory inode
+ * @param name Name of the entry
+ * @param child Inode the entry refers to
+ * @return 0 if successful, -1 if the directory can't grow (the largest
+ *         directory, or no free block)
  */
-int oufs_read_inode_by_reference(INODE_REFERENCE i, INODE *inode)
+int oufs_directory_add(INODE_REFERENCE dir, const char *name, INODE_REFERENCE child)
 {
-	if(debug)
-		fprintf(stderr, "##Fetching inode %d\n", i);
+	INODE inode;
+	if (oufs_read_inode_by_reference(dir, &inode) != 0)
+		return -1;
+
+	OUFS_BMAP map;
+	oufs_bmap_begin(&map, &inode);
+	int n_blocks = oufs_directory_n_blocks(&map);
+	int ret = -1;
 
-	// Find the address of the inode block and the inode within the block
-	BLOCK_REFERENCE block = i / INODES_PER_BLOCK + 1;
-	int element = (i % INODES_PER_BLOCK);
+	BLOCK block0;
+	if (oufs_directory_read(&map, 0, &block0) != 0) {
+		oufs_bmap_end(&map);
+		return -1;
+	}
+	unsigned int root = oufs_dx_root(&block0);
+
+	if (root == 0) {
+		OUFS_DIRECTORY_HINT *hint = oufs_directory_hint(dir);
+		BLOCK block;
+		unsigned int file_block = 0;
+		int slot = -1;
+
+		//Look for a free slot, unless the entry count says every block is full.
+		//Start at the hint, wrapping around in case it is out of date
+		if (inode.size < (unsigned int) n_blocks * DIRECTORY_ENTRIES_PER_BLOCK) {
+			int start = hint->block < n_blocks ? hint->block : 0;
+			for (int k = 0; k < n_blocks && slot < 0; k++) {
+				file_block = (start + k) % n_blocks;
+				if (oufs_directory_read(&map, file_block, &block) != 0) {
+					oufs_bmap_end(&map);
+					return -1;
+				}
+				slot = oufs_directory_scan(block.directory.entry, DIRECTORY_ENTRIES_PER_BLOCK, NULL, 0);
+				hint->block = file_block;
+			}
+		}
 
-	BLOCK b;
-	if(vdisk_read_block(block, &b) == 0) {
-		// Successfully loaded the block: copy just this inode
-		*inode = b.inodes.inode[element];
-		return(0);
+		if (slot >= 0) {
+			strcpy(block.directory.entry[slot].name, name);
+			block.directory.entry[slot].inode_reference = child;
+			ret = oufs_directory_write(&map, file_block, &block);
+		}
+		else if ((oufs_geometry()->features & SUPERBLOCK_FEATURE_DIR_INDEX) &&
+			 n_blocks >= DIRECTORY_INDEX_THRESHOLD && oufs_dx_convert(&map, &n_blocks, &block0) == 0) {
+			ret = oufs_dx_add(&map, &n_blocks, 1, name, child);
+		}
+		else if (oufs_directory_grow(&map, &n_blocks, &file_block) == 0) {
+			//Full: add a block of empty entries
+			for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++)
+				oufs_clean_directory_entry(&block.directory.entry[i]);
+			strcpy(block.directory.entry[0].name, name);
+			block.directory.entry[0].inode_reference = child;
+			ret = oufs_directory_write(&map, file_block, &block);
+			hint->block = file_block;
+		}
+	}
+	else {
+		ret = oufs_dx_add(&map, &n_blocks, root, name, child);
 	}
-	// Error case
-	return(-1);
+	oufs_bmap_end(&map);
+
+	if (ret != 0)
+		return -1;
+	oufs_dcache_invalidate(dir, name);
+	inode.size = inode.size + 1;
+	oufs_write_inode_by_reference(dir, &inode);
+	return 0;
 }
 
 /**
- *  Given an inode reference, write the inode to the virtual disk.
- *
- *  @param i Inode reference (index into the inode list)
- *  @param inode Pointer to an inode memory structure.  This structure will be
- *                filled written to the disk)
- *  @return 0 = successfully loaded the inode
- *         -1 = an error has occurred
+ * Remove an entry from a directory.  The directory keeps its blocks
  *
+ * @param dir Directory inode
+ * @param name Name of the entry
+ * @return The inode the entry referred to, or UNALLOCATED_INODE if there
+ *         is no such entry
  */
-int oufs_write_inode_by_reference(INODE_REFERENCE i, INODE *inode)
+INODE_REFERENCE oufs_directory_remove(INODE_REFERENCE dir, const char *name)
 {
-	if(debug)
-		fprintf(stderr, "##Writing to inode %d\n", i);
-
-	// Find the address of the inode block and the inode within the block
-	BLOCK_REFERENCE block = i / INODES_PER_BLOCK + 1;
-	int element = (i % INODES_PER_BLOCK);
-
-	BLOCK b;
-	if(vdisk_read_block(block, &b) == 0) {
-		// Successfully loaded the block: only change specified inode
+	INODE inode;
+	if (oufs_read_inode_by_reference(dir, &inode) != 0)
+		return UNALLOCATED_INODE;
 
-		b.inodes.inode[element] = *inode; //Copied inode to block
+	OUFS_BMAP map;
+	oufs_bmap_begin(&map, &inode);
+	INODE_REFERENCE child = UNALLOCATED_INODE;
+	BLOCK block;
+	unsigned int root = 0;
+
+	for (int b = 0; child == UNALLOCATED_INODE && root == 0 && oufs_directory_read(&map, b, &block) == 0; b++) {
+		if (b == 0)
+			root = oufs_dx_root(&block);
+		int i = oufs_directory_scan(block.directory.entry, DIRECTORY_ENTRIES_PER_BLOCK, name, strlen(name));
+		if (i >= 0) {//If entry is the removed file, overwrite entry
+			child = block.directory.entry[i].inode_reference;
+			oufs_clean_directory_entry(&(block.directory.entry[i]));
+			oufs_directory_write(&map, b, &block);
 
-		//Write block back to disk
-		if(vdisk_write_block(block, &b) != 0)
-		{
-			return(-1);
+			//This block has a free slot now
+			OUFS_DIRECTORY_HINT *hint = oufs_directory_hint(dir);
+			hint->block = MIN(hint->block, b);
 		}
-
-		return(0);
 	}
-	// Error case
-	return(-1);
+	if (root != 0 && child == UNALLOCATED_INODE)
+		child = oufs_dx_remove(&map, root, name);
+	oufs_bmap_end(&map);
+
+	if (child != UNALLOCATED_INODE) {
+		oufs_dcache_invalidate(dir, name);
+		inode.size = inode.size - 1;
+		oufs_write_inode_by_reference(dir, &inode);
+	}
+	return child;
 }
 
 /**
- *  Given an unsigned char (1 byte), return the index of the first 0 bit
- *
- *  @param value Byte to find open bit in
- *
- *  @return Index 0-7 indicating open bytes
-Return -1 on error
+ * Read all of the entries of a directory
  *
+ * @param inode The directory's inode
+ * @param entries Set to a malloc()ed array of the entries in use (to be
+ *                freed by the caller)
+ * @return Number of entries, or -1 if out of memory or a block can't be read
  */
-int oufs_find_open_bit(unsigned char value)
+int oufs_directory_entries(INODE *inode, DIRECTORY_ENTRY **entries)
 {
-	//xxxx xxxx
-	int i;
-	for (i = 0; i < 8; i++)
-	{
-		if (!(value & (1 << i)))
-		{
-			return i; //Found a 0 bit
-		}
+	OUFS_BMAP map;
+	oufs_bmap_begin(&map, inode);
+	int n_blocks = oufs_directory_n_blocks(&map);
+	int max = n_blocks * DIRECTORY_ENTRIES_PER_BLOCK;
+
+	*entries = malloc(((size_t) max + 1) * sizeof(DIRECTORY_ENTRY));
+	if (*entries == NULL) {
+		oufs_bmap_end(&map);
+		return -1;
 	}
 
-	fprintf(stderr, "Error: oufs_find_open_bit() failed\n");
-	return -1; //All bits are 0
+	int n = 0;
+	BLOCK block;
+	for (int b = 0; b < n_blocks; b++) {
+		if (oufs_directory_read(&map, b, &block) != 0) {
+			free(*entries);
+			*entries = NULL;
+			oufs_bmap_end(&map);
+			return -1;
+		}
+		unsigned int root = b == 0 ? oufs_dx_root(&block) : 0;
+		for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++) {
+			if (block.directory.entry[i].inode_reference != UNALLOCATED_INODE &&
+			    block.directory.entry[i].name[0] != '/')
+				(*entries)[n++] = block.directory.entry[i];
+		}
+		if (root != 0) {
+			//Indexed: the rest are in the leaves
+			oufs_dx_collect(&map, root, *entries, &n, max);
+			break;
+		}
+	}
+	oufs_bmap_end(&map);
+	return n;
 }
 
 /**
@@ -488,32 +3030,16 @@ int oufs_mkdir(char *cwd, char *path)
 		return -5;
 	}
 
-	//Update parent inode
-	INODE inode;
-	oufs_read_inode_by_reference(parent, &inode);
-	inode.size = inode.size + 1;
-	if (inode.size > DIRECTORY_ENTRIES_PER_BLOCK) { //No more room in parent directory
+	//Update parent inode and directory block
+	if (oufs_directory_add(parent, local_name, inode_ref) != 0) { //No more room in parent directory
 		fprintf(stderr, "Error: No more room in parent directory for more entries\n");
 		oufs_deallocate_old_block(new_dir_block);
 		oufs_deallocate_old_inode(inode_ref);
 		return -6;
 	}
-	oufs_write_inode_by_reference(parent, &inode);
 
+	INODE inode;
 	BLOCK block;
-	//Update parent directory block
-	vdisk_read_block(inode.data[0], &block);
-	//Put in entry in first availible entry space
-	int i;
-	for (i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++)
-	{
-		if (strcmp(block.directory.entry[i].name, "") == 0) {//If entry is empty, write in, and break from for loop
-			strcpy(block.directory.entry[i].name, local_name);
-			block.directory.entry[i].inode_reference = inode_ref;
-			vdisk_write_block(inode.data[0], &block);
-			break;
-		}
-	}
 
 	//Create a new inode for the new directory
 	oufs_clean_inode(&inode);
@@ -528,7 +3054,7 @@ int oufs_mkdir(char *cwd, char *path)
 	//Initialize the new directory block
 	oufs_clean_directory_block(inode_ref, parent, &block);
 	//Write directory block to disk
-	vdisk_write_block(new_dir_block, &block);
+	oufs_write_directory_block(new_dir_block, &block);
 
 	return 0;
 }
@@ -597,51 +3123,270 @@ int oufs_rmdir(char *cwd, char *path)
 	}
 
 
-	BLOCK_REFERENCE old_dir_block = inode.data[0];
-
+	//Zero out the directory's blocks and release them
+	OUFS_BMAP map;
+	BLOCK_REFERENCE old_dir_block;
+	oufs_bmap_begin(&map, &inode);
 	oufs_clean_block(&block); //Write the block to be all 0's
-	vdisk_write_block(old_dir_block, &block);
-	oufs_deallocate_old_block(old_dir_block);
+	for (int b = 0; oufs_bmap(&map, b, 1, &old_dir_block, 0) == 1 && old_dir_block != UNALLOCATED_BLOCK; b++)
+		vdisk_write_block(old_dir_block, &block);
+	oufs_bmap_end(&map);
+	oufs_bmap_truncate(&inode, 0);
 
 	//Update inode block
 	oufs_clean_inode(&inode);
 	oufs_write_inode_by_reference(child, &inode);
 	oufs_deallocate_old_inode(child);
+	oufs_dcache_invalidate(child, NULL);
+	oufs_bump_generation();
 
 
 	//Update parent directory (clear entry and inode pointer)
 	// and inode (decrement size)
+	oufs_directory_remove(parent, local_name);
 
-	//Update parent inode
-	oufs_read_inode_by_reference(parent, &inode);
-	inode.size = inode.size - 1;
-	oufs_write_inode_by_reference(parent, &inode);
+	return 0;
+}
 
-	//Update parent directory block
-	vdisk_read_block(inode.data[0], &block);
-	//Remove directory entry for removed file
-	int i;
-	for (i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++)
-	{
-		if (strcmp(block.directory.entry[i].name, local_name) == 0) {//If entry is the removed file, overwrite entry, and break from for loop
-			oufs_clean_directory_entry(&(block.directory.entry[i]));
-			vdisk_write_block(inode.data[0], &block);
-			break;
+/**
+ * Open a directory for reading, by inode.  The inodes of its entries are
+ * prefetched, an inode block at a time
+ *
+ * @param dir Directory inode
+ * @param flags OUFS_READDIR_SORTED to return the entries in ASCII order;
+ *              OUFS_READDIR_NO_PREFETCH if the caller fetches the inodes
+ * @return The open directory (to be closed with oufs_closedir()), or NULL
+ *         if dir is not a directory or on error
+ */
+OUFS_DIR *oufs_opendir_inode(INODE_REFERENCE dir, int flags)
+{
+	INODE inode;
+	if (oufs_read_inode_by_reference(dir, &inode) != 0)
+		return NULL;
+	if (inode.type != IT_DIRECTORY) {
+		fprintf(stderr, "Error: not a directory\n");
+		return NULL;
+	}
+
+	OUFS_DIR *d = malloc(sizeof(OUFS_DIR));
+	if (d == NULL)
+		return NULL;
+	d->inode_reference = dir;
+	d->next = 0;
+	d->n_entries = oufs_directory_entries(&inode, &d->entries);
+	if (d->n_entries < 0) {
+		free(d);
+		return NULL;
+	}
+
+	if (flags & OUFS_READDIR_SORTED)
+		qsort(d->entries, d->n_entries, sizeof(DIRECTORY_ENTRY), oufs_dir_entry_cmp);
+	if (flags & OUFS_READDIR_NO_PREFETCH)
+		return d;
+
+	//Fetch the entries' inodes now rather than one by one in oufs_readdir()
+	INODE_REFERENCE *refs = malloc((d->n_entries + 1) * sizeof(INODE_REFERENCE));
+	if (refs != NULL) {
+		for (int i = 0; i < d->n_entries; i++)
+			refs[i] = d->entries[i].inode_reference;
+		oufs_prefetch_inodes(refs, d->n_entries);
+		free(refs);
+	}
+	return d;
+}
+
+/**
+ * Open a directory for reading
+ *
+ * @param cwd Current working directory of OUFS
+ * @param path Path of the directory, or NULL for cwd
+ * @param flags OUFS_READDIR_SORTED to return the entries in ASCII order
+ * @return The open directory (to be closed with oufs_closedir()), or NULL
+ *         on error
+ */
+OUFS_DIR *oufs_opendir(char *cwd, char *path, int flags)
+{
+	INODE_REFERENCE parent;
+	INODE_REFERENCE child;
+	char local_name[FILE_NAME_SIZE];
+
+	if (path == NULL) {
+		if (oufs_find_cwd(cwd, &parent, &child, local_name) != 0)
+			return NULL;
+	}
+	else if (oufs_find_file(cwd, path, &parent, &child, local_name) != 0)
+		return NULL;
+
+	if (child == UNALLOCATED_INODE) {
+		fprintf(stderr, "Error: file does not exist\n");
+		return NULL;
+	}
+	return oufs_opendir_inode(child, flags);
+}
+
+/**
+ * Read the next entry of an open directory
+ *
+ * @param dir The open directory
+ * @param dirent Filled in with the entry's name, inode and type
+ * @return 1 if there was an entry, 0 at the end of the directory
+ */
+int oufs_readdir(OUFS_DIR *dir, OUFS_DIRENT *dirent)
+{
+	if (dir->next >= dir->n_entries)
+		return 0;
+
+	const DIRECTORY_ENTRY *entry = &dir->entries[dir->next++];
+	strcpy(dirent->name, entry->name);
+	dirent->inode_reference = entry->inode_reference;
+	INODE *inode = oufs_cached_inode(entry->inode_reference);
+	dirent->type = inode != NULL ? inode->type : IT_NONE;
+	return 1;
+}
+
+/**
+ * Close a directory opened by oufs_opendir()
+ *
+ * @param dir The open directory
+ */
+void oufs_closedir(OUFS_DIR *dir)
+{
+	if (dir == NULL)
+		return;
+	free(dir->entries);
+	free(dir);
+}
+
+/**
+ * Print one directory entry for a listing
+ *
+ * @param dirent The entry
+ * @param flags OUFS_LIST_LONG for the type, size, link count and block count
+ */
+static void oufs_list_entry(const OUFS_DIRENT *dirent, int flags)
+{
+	if (flags & OUFS_LIST_LONG) {
+		INODE inode;
+		if (oufs_read_inode_by_reference(dirent->inode_reference, &inode) == 0)
+			printf("%c %10u %3u %6d ", inode.type, inode.size, inode.n_references, oufs_inode_n_blocks(&inode));
+	}
+	printf("%s%s\n", dirent->name, dirent->type == IT_DIRECTORY ? "/" : "");
+}
+
+/**
+ * Free the paths of a level of a tree listing
+ */
+static void oufs_list_free_level(INODE_REFERENCE *level, char **paths, int n_level)
+{
+	for (int d = 0; paths != NULL && d < n_level; d++)
+		free(paths[d]);
+	free(level);
+	free(paths);
+}
+
+/**
+ * List a directory tree breadth first: a level at a time, with the inodes
+ * of every entry of the level fetched together, in inode-block order
+ *
+ * @param dir The top directory
+ * @param path Its path, as given
+ * @param flags OUFS_LIST_LONG for long listings
+ * @return 0 if successful, negative for failure
+ */
+static int oufs_list_tree(INODE_REFERENCE dir, const char *path, int flags)
+{
+	//The directories of the level, with their paths
+	int n_level = 1;
+	INODE_REFERENCE *level = malloc(sizeof(INODE_REFERENCE));
+	char **paths = calloc(1, sizeof(char *));
+	if (level == NULL || paths == NULL || (paths[0] = strdup(path)) == NULL) {
+		oufs_list_free_level(level, paths, 1);
+		return -3;
+	}
+	level[0] = dir;
+	int first = 1;
+
+	while (n_level > 0) {
+		//Read every directory of the level, then fetch all of their entries' inodes
+		OUFS_DIR **dirs = calloc(n_level, sizeof(OUFS_DIR *));
+		if (dirs == NULL) {
+			oufs_list_free_level(level, paths, n_level);
+			return -3;
+		}
+		int n_refs = 0;
+		for (int d = 0; d < n_level; d++) {
+			dirs[d] = oufs_opendir_inode(level[d], OUFS_READDIR_SORTED | OUFS_READDIR_NO_PREFETCH);
+			if (dirs[d] != NULL)
+				n_refs += dirs[d]->n_entries;
+		}
+
+		INODE_REFERENCE *refs = malloc((n_refs + 1) * sizeof(INODE_REFERENCE));
+		INODE_REFERENCE *next = malloc((n_refs + 1) * sizeof(INODE_REFERENCE));
+		char **next_paths = calloc(n_refs + 1, sizeof(char *));
+		if (refs == NULL || next == NULL || next_paths == NULL) {
+			for (int d = 0; d < n_level; d++)
+				oufs_closedir(dirs[d]);
+			free(dirs);
+			free(refs);
+			free(next);
+			free(next_paths);
+			oufs_list_free_level(level, paths, n_level);
+			return -3;
+		}
+		n_refs = 0;
+		for (int d = 0; d < n_level; d++) {
+			for (int i = 0; dirs[d] != NULL && i < dirs[d]->n_entries; i++)
+				refs[n_refs++] = dirs[d]->entries[i].inode_reference;
 		}
+		oufs_prefetch_inodes(refs, n_refs);
+		free(refs);
+
+		//Print the level, gathering the directories of the next one
+		int n_next = 0;
+		for (int d = 0; d < n_level; d++) {
+			if (dirs[d] == NULL)
+				continue;
+			printf("%s%s:\n", first ? "" : "\n", paths[d]);
+			first = 0;
+
+			OUFS_DIRENT dirent;
+			while (oufs_readdir(dirs[d], &dirent)) {
+				oufs_list_entry(&dirent, flags);
+				if (dirent.type != IT_DIRECTORY || strcmp(dirent.name, ".") == 0 || strcmp(dirent.name, "..") == 0)
+					continue;
+
+				size_t length = strlen(paths[d]) + strlen(dirent.name) + 2;
+				int slash = paths[d][0] != '\0' && paths[d][strlen(paths[d]) - 1] != '/';
+				if ((next_paths[n_next] = malloc(length)) == NULL)
+					continue;
+				snprintf(next_paths[n_next], length, "%s%s%s", paths[d], slash ? "/" : "", dirent.name);
+				next[n_next++] = dirent.inode_reference;
+			}
+			oufs_closedir(dirs[d]);
+		}
+
+		free(dirs);
+		oufs_list_free_level(level, paths, n_level);
+		level = next;
+		paths = next_paths;
+		n_level = n_next;
 	}
 
+	oufs_list_free_level(level, paths, 0);
 	return 0;
 }
 
 /**
- * List a info about a file or about cwd if path is null
+ * List a file, a directory or a directory tree
  *
- * @param char * cwd Current working directory of OUFS
- * @param char * path Path of the new directory to be made, null will list info about cwd
+ * @param cwd Current working directory of OUFS
+ * @param path Path to list, or NULL for cwd
+ * @param flags OUFS_LIST_LONG for the type, size, link count and block
+ *              count of each entry; OUFS_LIST_RECURSIVE to list the
+ *              directories below as well
  * @return 0 if successful, negative for failure
- *
  */
-int oufs_list(char *cwd, char *path)
+int oufs_list_flags(char *cwd, char *path, int flags)
 {
 	if(debug)
 	fprintf(stderr,"##oufs_list, cwd: %s, path: %s\n", cwd, path);
@@ -652,7 +3397,8 @@ int oufs_list(char *cwd, char *path)
 	char local_name[FILE_NAME_SIZE];
 
 	if (path == NULL) { //path is NULL, list info about cwd instead of path
-		oufs_find_file(cwd, cwd, &parent, &child, local_name);
+		if (oufs_find_cwd(cwd, &parent, &child, local_name) != 0)
+		return -1;
 	}
 	else { //List info about path
 		if (oufs_find_file(cwd, path, &parent, &child, local_name) != 0)
@@ -669,52 +3415,53 @@ int oufs_list(char *cwd, char *path)
 	}
 
 	INODE inode;
-	BLOCK block;
-	DIRECTORY_ENTRY d_entry;
-	int i;
+	OUFS_DIR *dir;
+	OUFS_DIRENT dirent;
 	//Fetch inode
 	oufs_read_inode_by_reference(child, &inode);
 
 	//If it is a file list its name
 	if (inode.type == IT_FILE) {
-		//Go to parent inode, go to parent dblock, get entry name that points to child
-		oufs_read_inode_by_reference(parent, &inode);
-		vdisk_read_block(inode.data[0], &block);
-
-		for(i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++) {
-			if (block.directory.entry[i].inode_reference == child) { //Found child directory entry
-				fprintf(stdout, "%s\n", block.directory.entry[i].name);
+		//Go to parent directory, get entry name that points to child
+		dir = oufs_opendir_inode(parent, OUFS_READDIR_NO_PREFETCH);
+		while (dir != NULL && oufs_readdir(dir, &dirent)) {
+			if (dirent.inode_reference == child) { //Found child directory entry
+				oufs_list_entry(&dirent, flags);
 				break;
 			}
 		}
-
+		oufs_closedir(dir);
 		return 0;
 	}
 
-	//Fetch child dblock in order to list contents
-	vdisk_read_block(inode.data[0], &block);
+	if (flags & OUFS_LIST_RECURSIVE)
+		return oufs_list_tree(child, path != NULL ? path : cwd, flags);
 
 	//Since file is a directory, list valid entries in ASCII order, with newlines and / at the end if entry is a directory
-	//Sort the array contained in block.directory.entry which is a DIRECTORY_ENTRY *
-
-	qsort(block.directory.entry, DIRECTORY_ENTRIES_PER_BLOCK, sizeof(d_entry), oufs_dir_entry_cmp);
-
-	//Block now has entries sorted in ASCII order. Lets print them.
+	dir = oufs_opendir_inode(child, OUFS_READDIR_SORTED);
+	if (dir == NULL)
+		return -3;
 
-	for(i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; ++i) {
-		if(block.directory.entry[i].inode_reference != UNALLOCATED_INODE) {
-			printf("%s", block.directory.entry[i].name);
-			oufs_read_inode_by_reference(block.directory.entry[i].inode_reference, &inode);
-			if (inode.type == IT_DIRECTORY) {
-				printf("/");
-			}
-			printf("\n");
-		}
-	}
+	while (oufs_readdir(dir, &dirent))
+		oufs_list_entry(&dirent, flags);
 
+	oufs_closedir(dir);
 	return 0;
 }
 
+/**
+ * List a info about a file or about cwd if path is null
+ *
+ * @param char * cwd Current working directory of OUFS
+ * @param char * path Path of the new directory to be made, null will list info about cwd
+ * @return 0 if successful, negative for failure
+ *
+ */
+int oufs_list(char *cwd, char *path)
+{
+	return oufs_list_flags(cwd, path, 0);
+}
+
 /**
  * Compares two entries passed by reference
  *
@@ -730,6 +3477,138 @@ int oufs_dir_entry_cmp(const void *entry_ref_1, const void *entry_ref_2)
 	return strcmp(((*((DIRECTORY_ENTRY*)entry_ref_1)).name), ((*((DIRECTORY_ENTRY*)entry_ref_2)).name));
 }
 
+/**
+ * Start walking over the components of a path.  The path is not changed
+ *
+ * @param it Walk state
+ * @param path The path
+ */
+void oufs_path_begin(OUFS_PATH_ITER *it, const char *path)
+{
+	it->next = path;
+}
+
+/**
+ * Get the next component of a path.  Repeated slashes are skipped; "."
+ * and ".." are components like any other (directories hold entries for
+ * them)
+ *
+ * @param it Walk state (see oufs_path_begin())
+ * @param name Set to the start of the component, which is not terminated
+ * @param length Set to the length of the component
+ * @return 1 if there is a component, 0 at the end of the path
+ */
+int oufs_path_next(OUFS_PATH_ITER *it, const char **name, int *length)
+{
+	const char *p = it->next;
+	while (*p == '/')
+		p++;
+	if (*p == '\0') {
+		it->next = p;
+		return 0;
+	}
+
+	const char *end = p;
+	while (*end != '\0' && *end != '/')
+		end++;
+	*name = p;
+	*length = end - p;
+	it->next = end;
+	return 1;
+}
+
+/**
+ * Slot of the dentry cache for a name in a directory
+ *
+ * @param parent Directory inode
+ * @param name Entry name
+ * @param length Length of the name
+ * @return Index into dentry_cache
+ */
+static unsigned int oufs_dcache_slot(INODE_REFERENCE parent, const char *name, int length)
+{
+	//FNV-1a over the directory and the name
+	unsigned int hash = 2166136261u ^ parent;
+	hash *= 16777619u;
+	for (int i = 0; i < length; i++) {
+		hash ^= (unsigned char) name[i];
+		hash *= 16777619u;
+	}
+	return hash & (N_DENTRY_CACHE - 1);
+}
+
+/**
+ * Look a name up in the dentry cache
+ *
+ * @param parent Directory inode
+ * @param name Entry name (need not be terminated)
+ * @param length Length of the name
+ * @param child Set to the entry's inode, or UNALLOCATED_INODE if the
+ *              directory is known not to have the name
+ * @return 1 if the cache knows the answer, 0 if not
+ */
+static int oufs_dcache_lookup(INODE_REFERENCE parent, const char *name, int length, INODE_REFERENCE *child)
+{
+	if (dentry_cache == NULL || length >= FILE_NAME_SIZE)
+		return 0;
+	OUFS_DENTRY *dentry = &dentry_cache[oufs_dcache_slot(parent, name, length)];
+	if (dentry->parent != parent || memcmp(dentry->name, name, length) != 0 || dentry->name[length] != '\0')
+		return 0;
+	*child = dentry->child;
+	return 1;
+}
+
+/**
+ * Remember the result of a directory lookup, replacing whatever shared its
+ * slot
+ *
+ * @param parent Directory inode
+ * @param name Entry name (need not be terminated)
+ * @param length Length of the name
+ * @param child The entry's inode, or UNALLOCATED_INODE if there is none
+ */
+static void oufs_dcache_insert(INODE_REFERENCE parent, const char *name, int length, INODE_REFERENCE child)
+{
+	if (length >= FILE_NAME_SIZE)
+		return; //Can't be in a directory; not worth a slot
+	if (dentry_cache == NULL) {
+		dentry_cache = malloc(N_DENTRY_CACHE * sizeof(OUFS_DENTRY));
+		if (dentry_cache == NULL)
+			return;
+		for (int i = 0; i < N_DENTRY_CACHE; i++)
+			dentry_cache[i].parent = UNALLOCATED_INODE;
+	}
+	OUFS_DENTRY *dentry = &dentry_cache[oufs_dcache_slot(parent, name, length)];
+	dentry->parent = parent;
+	dentry->child = child;
+	memcpy(dentry->name, name, length);
+	dentry->name[length] = '\0';
+}
+
+/**
+ * Forget what the dentry cache knows about a name in a directory.  Must be
+ * called whenever a directory entry is added or removed
+ *
+ * @param parent Directory inode
+ * @param name Entry name, or NULL for every name in the directory (when
+ *             the directory itself goes away)
+ */
+void oufs_dcache_invalidate(INODE_REFERENCE parent, const char *name)
+{
+	if (dentry_cache == NULL)
+		return;
+	if (name != NULL) {
+		OUFS_DENTRY *dentry = &dentry_cache[oufs_dcache_slot(parent, name, strlen(name))];
+		if (dentry->parent == parent && strcmp(dentry->name, name) == 0)
+			dentry->parent = UNALLOCATED_INODE;
+		return;
+	}
+	for (int i = 0; i < N_DENTRY_CACHE; i++) {
+		if (dentry_cache[i].parent == parent)
+			dentry_cache[i].parent = UNALLOCATED_INODE;
+	}
+}
+
 /**
  * Given current working directory and a path returns info about the file pointed to by path
  *
@@ -751,23 +3630,24 @@ int oufs_dir_entry_cmp(const void *entry_ref_1, const void *entry_ref_2)
  *
  *	-1 if path contains a file that is not a directory
  */
-int oufs_find_file(char *cwd, char * path, INODE_REFERENCE *parent, INODE_REFERENCE *child, char *local_name)
+int oufs_find_file(const char *cwd, const char *path, INODE_REFERENCE *parent, INODE_REFERENCE *child, char *local_name)
 {
 	if(debug)
 	fprintf(stderr, "##Finding file from cwd: %s, to %s\n", cwd, path);
 
 	INODE_REFERENCE cur_inode[2] = {UNALLOCATED_INODE, UNALLOCATED_INODE};
-	char * cur_file_name[2];
+	//Name of the last file found in the path
+	char cur_file_name[FILE_NAME_SIZE] = "";
 	//If path doesn't start from / find starting inode
 	//Else starting inode is inode 0, root directory
 	if ((*path) == '/') { //path is absolute
 		cur_inode[0] = 0;
-		cur_file_name[1] = "/";
+		strcpy(cur_file_name, "/");
 
 		if(debug)
 		{
 			fprintf(stderr, "##%s is absolute\n", path);
-			fprintf(stderr, "##cur_inode: %d cur_file_name: %s\n", cur_inode[0], cur_file_name[1]);
+			fprintf(stderr, "##cur_inode: %d cur_file_name: %s\n", cur_inode[0], cur_file_name);
 		}
 	}
 	else { //Path is relative
@@ -775,26 +3655,34 @@ int oufs_find_file(char *cwd, char * path, INODE_REFERENCE *parent, INODE_REFERE
 		fprintf(stderr, "##%s is relative\n", path);
 
 		//Need to determine starting inode from cwd
-		char buffer_string[FILE_NAME_SIZE];
-		oufs_find_file(cwd, cwd, &(cur_inode[1]), &(cur_inode[0]), buffer_string);
-		cur_file_name[1] = buffer_string;
+		if (oufs_find_cwd(cwd, &(cur_inode[1]), &(cur_inode[0]), cur_file_name) != 0)
+			return -1;
 		if(debug)
 		{
 			fprintf(stderr, "##For cwd: %s we found...\n", cwd);
-			fprintf(stderr, "###cur_inode: %d cur_file_name: %s\n", cur_inode[0], cur_file_name[1]);
+			fprintf(stderr, "###cur_inode: %d cur_file_name: %s\n", cur_inode[0], cur_file_name);
 		}
 	}
 
 	//Parse path i.e. foo/bar or /baz/foo/bar
 	//Use parsed path to trace to the child cur_inode[0], keeping track of parent in cur_inode[1]
-	cur_file_name[0]= strtok(path, "/");
+	OUFS_PATH_ITER it;
+	const char *name;
+	int length;
+	oufs_path_begin(&it, path);
 
 	//If empty, leave cur_inode alone. Else find inode for d_entry local_name
 
-	while (cur_file_name[0]!= NULL) //While there are still tokens
+	while (oufs_path_next(&it, &name, &length)) //While there are still components
 	{
 		if(debug)
-		fprintf(stderr, "##Seeking the inode for file: %s, from cur_inode: %d\n", cur_file_name[0], cur_inode[0]);
+		fprintf(stderr, "##Seeking the inode for file: %.*s, from cur_inode: %d\n", length, name, cur_inode[0]);
+
+		//A directory entry cannot hold the name
+		if (length >= FILE_NAME_SIZE) {
+			fprintf(stderr, "Error: file name too long: %.*s\n", length, name);
+			return -1;
+		}
 
 		cur_inode[1] = cur_inode[0];
 		if (cur_inode[1] == UNALLOCATED_INODE) {
@@ -809,66 +3697,80 @@ int oufs_find_file(char *cwd, char * path, INODE_REFERENCE *parent, INODE_REFERE
 			oufs_read_inode_by_reference(cur_inode[1], &inode);
 
 			if (inode.type == IT_DIRECTORY) { //Check that inode[1] refers to a directory block
-				cur_inode[0] = oufs_find_entry(&inode, cur_file_name[0]);
+				if (!oufs_dcache_lookup(cur_inode[1], name, length, &cur_inode[0])) {
+					cur_inode[0] = oufs_find_entry(&inode, name, length);
+					oufs_dcache_insert(cur_inode[1], name, length, cur_inode[0]);
+				}
 			}
 			else {
 				fprintf(stderr, "Error, invalid file path: %s\n", path);
 				return -1;
 			}
 			if (debug)
-			fprintf(stderr, "##For name: %s we found inode: %d \n###in directory with name: %s and inode: %d\n", cur_file_name[0], cur_inode[0], cur_file_name[1], cur_inode[1]);
+			fprintf(stderr, "##For name: %.*s we found inode: %d \n###in directory with name: %s and inode: %d\n", length, name, cur_inode[0], cur_file_name, cur_inode[1]);
 		}
 
-		cur_file_name[1] = cur_file_name[0];
-		cur_file_name[0]= strtok(NULL, "/");
+		memcpy(cur_file_name, name, length);
+		cur_file_name[length] = '\0';
 	}
 
 	if(debug)
-	fprintf(stderr, "##Done parsing path, returning cur_inode: %d, inode's parent: %d, local_file_name: %s\n", cur_inode[0], cur_inode[1], cur_file_name[1]);
+	fprintf(stderr, "##Done parsing path, returning cur_inode: %d, inode's parent: %d, local_file_name: %s\n", cur_inode[0], cur_inode[1], cur_file_name);
 
 	(*parent) = cur_inode[1];
 	(*child) = cur_inode[0];
-	strcpy(local_name, cur_file_name[1]);
+	strcpy(local_name, cur_file_name);
 
 	return 0;
 }
 
 /**
- * Given current an inode reference and an entry name, checks if entry is in the directory
+ * Given a directory inode and an entry name, checks if entry is in the directory
  *
- * @param char *cwd Current working directory of OUFS
- * @param char *path path pointing to file of interest
- * @param INODE_REFERENCE *parent Reference to store inode location of parent of file of interest
- * @param INODE_REFERENCE *child Reference to store inode location of file of interest
- * @param char *local_name Reference to store the name of the file of interest
+ * @param INODE *inode Inode of the directory
+ * @param char *entry_name Name to look for (need not be terminated)
+ * @param int length Length of the name
  *
  * @return INODE_REFERENCE of entry if found, or UNALLOCATED_INODE if there is no such entry
  *
  *
  */
-INODE_REFERENCE oufs_find_entry(INODE *inode, char *entry_name)
+INODE_REFERENCE oufs_find_entry(INODE *inode, const char *entry_name, int length)
 {
 	if(debug)
-	fprintf(stderr, "##Looking for entry %s in with inode pointing to block %d\n", entry_name, inode->data[0]);
+	fprintf(stderr, "##Looking for entry %.*s in with inode pointing to block %d\n", length, entry_name, inode->data[0]);
 
-	BLOCK block;
+	//A name that long can't be in a directory entry
+	if (length <= 0 || length >= FILE_NAME_SIZE)
+		return UNALLOCATED_INODE;
 
-	//Read directory block
-	vdisk_read_block(inode->data[0], &block);
+	BLOCK block;
+	OUFS_BMAP map;
+	oufs_bmap_begin(&map, inode);
 
-	//Search each directory entry checking names against entry_name
+	//Search each directory entry of each directory block checking names against entry_name
 	//When found return inode reference pointed to by entry
 	//Else, return UNALLOCATED_INODE
 
-	int i;
-	for (i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++) { //Check each directory entry
-		if (strcmp(entry_name, block.directory.entry[i].name) == 0) {
+	for (int b = 0; oufs_directory_read(&map, b, &block) == 0; b++) {
+		int i = oufs_directory_scan(block.directory.entry, DIRECTORY_ENTRIES_PER_BLOCK, entry_name, length);
+		if (i >= 0) {
 			//Match!
 			if (debug)
-			fprintf(stderr, "##Found entry %s\n", entry_name);
+			fprintf(stderr, "##Found entry %.*s\n", length, entry_name);
+			oufs_bmap_end(&map);
 			return block.directory.entry[i].inode_reference;
 		}
+
+		//Indexed directory: block 0 has only "." and "..", the index finds the rest
+		unsigned int root = b == 0 ? oufs_dx_root(&block) : 0;
+		if (root != 0) {
+			INODE_REFERENCE child = oufs_dx_lookup(&map, root, entry_name, length);
+			oufs_bmap_end(&map);
+			return child;
+		}
 	}
+	oufs_bmap_end(&map);
 
 	if (debug)
 	fprintf(stderr, "##Entry not found\n");
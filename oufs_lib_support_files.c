@@ -3,7 +3,8 @@
 #include "oufs_lib.h"
 
 #define debug 0
-static int BUFFER_SIZE = BLOCK_SIZE;
+// Size of the stdin/stdout buffers used by create, append and more
+#define BUFFER_SIZE BLOCK_SIZE
 
 /**
  * Create a new file
@@ -46,7 +47,6 @@ int oufs_create(char *cwd, char *path) {
       break;
     }
 
-    fp->offset = fp->offset + ret;
     len = fread(buf, 1, BLOCK_SIZE, stdin);
   }
 
@@ -81,7 +81,6 @@ int oufs_append(char *cwd, char *path) {
       break;
     }
 
-    fp->offset = fp->offset + ret;
     len = fread(buf, 1, BLOCK_SIZE, stdin);
   }
 
@@ -109,7 +108,6 @@ int oufs_more(char *cwd, char *path) {
   fprintf(stdout, "%s", buf);
 
   while (ret != 0) {
-    fp->offset = fp->offset + ret; //Update offset after read of first 256 bytes
     ret = oufs_fread(fp, buf, BUFFER_SIZE);
     buf[ret] = '\0';
     fprintf(stdout, "%s", buf);
@@ -120,12 +118,46 @@ int oufs_more(char *cwd, char *path) {
   return 0;
 }
 
+/**
+ * Make a handle for an open file
+ *
+ * @param child The file's inode reference
+ * @param inode The file's inode
+ * @param mode 'r', 'a', 'w' or '+' (r+)
+ * @param offset Where reading or writing starts
+ * @return The handle, or NULL if out of memory
+ */
+static OUFILE *oufs_new_handle(INODE_REFERENCE child, INODE *inode, char mode, int offset) {
+  OUFILE *fp = malloc(sizeof(OUFILE));
+  if (fp == NULL) {
+    fprintf(stderr, "Out of memory, can't open file\n");
+    return NULL;
+  }
+  fp->inode_reference = child;
+  fp->mode = mode;
+  fp->offset = offset;
+  fp->inode = *inode;
+  fp->inode_dirty = 0;
+  fp->buffer_block = -1;
+  fp->buffer_ref = UNALLOCATED_BLOCK;
+  fp->buffer_dirty = 0;
+  char *sparse = getenv("ZSPARSE");
+  fp->sparse = sparse != NULL && strcmp(sparse, "0") != 0;
+  fp->ra_window = NULL;
+  fp->ra_start = 0;
+  fp->ra_count = 0;
+  fp->ra_size = 0;
+  fp->ra_next = offset;
+  return fp;
+}
+
 /**
  * Opens a file for reading and writing
  *
  * @param char * cwd Current working directory of OUFS
  * @param char * path Path of the new directory to be made, null will list info about cwd
- * @param char * mode Either r, a, or w For read, write, append respectively
+ * @param char * mode Either r, a, or w For read, write, append respectively,
+ *                    or r+ to read and write an existing file in place
  * @return OUFILE * pointing to OUFILE struct if successful, NULL on failure
  *
  */
@@ -139,8 +171,8 @@ OUFILE* oufs_fopen(char *cwd, char *path, char *mode) {
     return NULL;
 
 
-  //case "r"
-  if (!strcmp(mode, "r"))
+  //case "r", and "r+" for reading and writing in place
+  if (!strcmp(mode, "r") || !strcmp(mode, "r+"))
   {
     if(debug)
     fprintf(stderr, "##Entered \"r\" mode for fopen\n");
@@ -158,11 +190,7 @@ OUFILE* oufs_fopen(char *cwd, char *path, char *mode) {
         return NULL;
       }
     }
-    OUFILE *fp = malloc(sizeof(OUFILE));
-    fp->inode_reference = child;
-    fp->mode = 'r';
-    fp->offset = 0;
-    return fp;
+    return oufs_new_handle(child, &inode, mode[1] == '+' ? '+' : 'r', 0);
   }
 
   //case "a"
@@ -183,30 +211,12 @@ OUFILE* oufs_fopen(char *cwd, char *path, char *mode) {
       }
 
       //Update Directory block, if full exit (deallocating child)
-      BLOCK d_block;
-      oufs_read_inode_by_reference(parent, &inode);
-      inode.size = inode.size + 1;
-      if (inode.size > DIRECTORY_ENTRIES_PER_BLOCK) {
+      if (oufs_directory_add(parent, local_name, child) != 0) {
         //Too many directory entries
         fprintf(stderr, "No room in parent directory for new file\n");
         oufs_deallocate_old_inode(child);
         return NULL;
       }
-      oufs_write_inode_by_reference(parent, &inode);
-
-      vdisk_read_block(inode.data[0], &d_block);
-
-      //Put in entry in first availible entry space
-      int i;
-      for (i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++)
-      {
-        if (strcmp(d_block.directory.entry[i].name, "") == 0) {//If entry is empty, write in, and break from for loop
-          strcpy(d_block.directory.entry[i].name, local_name);
-          d_block.directory.entry[i].inode_reference = child;
-          vdisk_write_block(inode.data[0], &d_block);
-          break;
-        }
-      }
 
       //Create a new inode for the new file
       oufs_clean_inode(&inode);
@@ -225,11 +235,7 @@ OUFILE* oufs_fopen(char *cwd, char *path, char *mode) {
       }
     }
 
-    OUFILE *fp = malloc(sizeof(OUFILE));
-    fp->inode_reference = child;
-    fp->mode = 'a';
-    fp->offset = inode.size;
-    return fp;
+    return oufs_new_handle(child, &inode, 'a', inode.size);
   }
 
   //case "w"
@@ -251,30 +257,12 @@ OUFILE* oufs_fopen(char *cwd, char *path, char *mode) {
       }
 
       //Update Directory block, if full exit (deallocating child)
-      BLOCK d_block;
-      oufs_read_inode_by_reference(parent, &inode);
-      inode.size = inode.size + 1;
-      if (inode.size > DIRECTORY_ENTRIES_PER_BLOCK) {
+      if (oufs_directory_add(parent, local_name, child) != 0) {
         //Too many directory entries
         fprintf(stderr, "No room in parent directory for new file\n");
         oufs_deallocate_old_inode(child);
         return NULL;
       }
-      oufs_write_inode_by_reference(parent, &inode);
-
-      vdisk_read_block(inode.data[0], &d_block);
-
-      //Put in entry in first availible entry space
-      int i;
-      for (i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++)
-      {
-        if (strcmp(d_block.directory.entry[i].name, "") == 0) {//If entry is empty, write in, and break from for loop
-          strcpy(d_block.directory.entry[i].name, local_name);
-          d_block.directory.entry[i].inode_reference = child;
-          vdisk_write_block(inode.data[0], &d_block);
-          break;
-        }
-      }
 
       //Create a new inode for the new file
       oufs_clean_inode(&inode);
@@ -293,22 +281,12 @@ OUFILE* oufs_fopen(char *cwd, char *path, char *mode) {
         return NULL;
       }
 
-      int i;
-      for (i = 0; i < BLOCKS_PER_INODE; i++) {
-        if (inode.data[i] != UNALLOCATED_BLOCK) {
-          oufs_deallocate_old_block(inode.data[i]);
-          inode.data[i] = UNALLOCATED_BLOCK;
-        }
-      }
+      oufs_bmap_truncate(&inode, 0);
       inode.size = 0;
       oufs_write_inode_by_reference(child, &inode);
     }
 
-    OUFILE *fp = malloc(sizeof(OUFILE));
-    fp->inode_reference = child;
-    fp->mode = 'w';
-    fp->offset = 0;
-    return fp;
+    return oufs_new_handle(child, &inode, 'w', 0);
   }
 
   fprintf(stderr, "Incorrect fopen call, no mode\n");
@@ -316,17 +294,98 @@ OUFILE* oufs_fopen(char *cwd, char *path, char *mode) {
 }
 
 /**
-   * Closes a file pointer
+ * Write the handle's block buffer back to the disk if it has changed
+ *
+ * @param OUFILE *fp File pointer for file of interest
+ * @return 0 if successful, -1 on error
+ */
+static int oufs_flush_buffer(OUFILE *fp) {
+  if (!fp->buffer_dirty)
+    return 0;
+  fp->buffer_dirty = 0;
+  return vdisk_write_block(fp->buffer_ref, &fp->buffer);
+}
+
+/**
+ * Load a file block into the handle's block buffer, writing back the
+ * block that was there
+ *
+ * @param OUFILE *fp File pointer for file of interest
+ * @param map Walk over the file's block map
+ * @param block_index The file block
+ * @param allocate 1 to allocate the block if the file does not have it
+ * @return 0 if successful, -1 if the block can't be allocated or read
+ */
+static int oufs_load_buffer(OUFILE *fp, OUFS_BMAP *map, int block_index, int allocate) {
+  if (fp->buffer_block == block_index) {
+    //A block read while the file did not have it gets one once written
+    if (allocate && fp->buffer_ref == UNALLOCATED_BLOCK &&
+        oufs_bmap(map, block_index, 1, &fp->buffer_ref, 1) != 1)
+      return -1;
+    return 0;
+  }
+  if (oufs_flush_buffer(fp) != 0)
+    return -1;
+  fp->buffer_block = -1;
+
+  BLOCK_REFERENCE block_ref;
+  if (oufs_bmap(map, block_index, 1, &block_ref, 0) != 1)
+    return -1;
+
+  //A block the file does not have reads as zeros.  A new block starts out
+  //as zeros too, without reading whatever the disk held there
+  if (block_ref == UNALLOCATED_BLOCK) {
+    if (allocate && oufs_bmap(map, block_index, 1, &block_ref, 1) != 1)
+      return -1;
+    memset(&fp->buffer, 0, BLOCK_SIZE);
+  }
+  else if (vdisk_read_block(block_ref, &fp->buffer) != 0)
+    return -1;
+
+  fp->buffer_block = block_index;
+  fp->buffer_ref = block_ref;
+  return 0;
+}
+
+/**
+ * Write back what a handle holds: its block buffer and its inode
+ *
+ * @param OUFILE *fp File pointer for file of interest
+ * @return 0 if successful, -1 on error
+ */
+int oufs_fflush(OUFILE *fp) {
+  if (fp == NULL) {
+    fprintf(stderr, "Invalid file pointer\n");
+    return -1;
+  }
+
+  int ret = oufs_flush_buffer(fp);
+  if (fp->inode_dirty) {
+    if (oufs_write_inode_by_reference(fp->inode_reference, &fp->inode) != 0)
+      ret = -1;
+    fp->inode_dirty = 0;
+  }
+  return ret;
+}
+
+/**
+   * Closes a file pointer, writing back what it holds
    *
    * @param OUFILE * fp File pointer to be closed
    *
    */
 void oufs_fclose(OUFILE *fp) {
+  if (fp == NULL)
+    return;
+  oufs_fflush(fp);
+  free(fp->ra_window);
   free(fp);
 }
 
 /**
- * Writes from a buffer to a file
+ * Writes from a buffer to a file at its offset, and moves the offset past
+ * the bytes written.  Parts of blocks are gathered in the handle's block
+ * buffer, which is written when it is filled or flushed
  *
  * @param OUFILE *fp file pointer for file of interest
  * @param unsigned char *buf Buffer containing contents to be written to file
@@ -340,180 +399,601 @@ int oufs_fwrite(OUFILE *fp, unsigned char * buf, int len) {
     return -1;
   }
 
-  if (!(fp->mode == 'a' || fp->mode == 'w')) {
+  if (!(fp->mode == 'a' || fp->mode == 'w' || fp->mode == '+')) {
     fprintf(stderr, "Invalid file pointer mode\n");
     return -1;
   }
 
-  INODE inode;
-  oufs_read_inode_by_reference(fp->inode_reference, &inode);
-
   //Set up variables for file copy
 
   //Index of block that we are writing to
-  int block_index = fp->offset / BLOCK_SIZE;
+  int block_index;
   //Offset inside of the block that we are writing to
-  int block_offset = fp->offset % BLOCK_SIZE;
+  int block_offset;
   //Offset inside the buffer we are writing from
   int buffer_offset = 0;
-  //Amount that has been written so far
-  int write_count = 0;
   //Amount that should be copied to the current file block
-  int copy_amount = MIN(BLOCK_SIZE - block_offset, len - buffer_offset);
-  BLOCK block;
-  BLOCK_REFERENCE block_reference;
+  int copy_amount;
+
+  //The readahead window may hold what is about to change
+  fp->ra_count = 0;
+
+  //Whole blocks are written a batch at a time, straight from buf with one
+  //vectored write: they replace the blocks' contents, so nothing is read
+  BLOCK_REFERENCE block_references[OUFS_IO_BATCH];
+  void *block_buffers[OUFS_IO_BATCH];
+  int n_blocks;
+  OUFS_BMAP map;
+  oufs_bmap_begin(&map, &fp->inode);
 
   if (debug) { //Debugging info about variables
-    fprintf(stderr, "##(Before loop)Writing to block data[%d] == %d at offset %d, %d bytes.\n##From buffer at offset %d. We have written %d so far.\n", block_index, inode.data[block_index], block_offset, copy_amount, buffer_offset, write_count);
+    fprintf(stderr, "##(Before loop)Writing %d bytes at offset %d\n", len, fp->offset);
   }
 
   //Continue while there is still data that should/can be copied
-  while (copy_amount > 0) {
-
-    //Check if block is already allocated, allocate new one if not
-    if (block_index >= BLOCKS_PER_INODE) { //File full, no more data blocks
-      if (debug) {
-        fprintf(stderr, "##No more blocks for inode, ending fwrite\n");
-      }
-      break;
-    }
-    else if (inode.data[block_index] == UNALLOCATED_BLOCK) {
-      //Allocate new data block
-      block_reference = oufs_allocate_new_block();
-      if (block_reference == UNALLOCATED_BLOCK) {
+  while (buffer_offset < len) {
+    block_index = fp->offset >> BLOCK_SHIFT;
+    block_offset = fp->offset & BLOCK_MASK;
+    copy_amount = MIN(BLOCK_SIZE - block_offset, len - buffer_offset);
+
+    if (copy_amount < BLOCK_SIZE || fp->buffer_block == block_index) {
+      //Part of a block: copy it into the block buffer
+      if (oufs_load_buffer(fp, &map, block_index, 1) != 0) { //File or file system full
         if (debug) {
-          fprintf(stderr, "##No more blocks in file system, ending fwrite\n");
+          fprintf(stderr, "##No more blocks for inode, ending fwrite\n");
         }
         break;
       }
-      inode.data[block_index] = block_reference;
+      memcpy(fp->buffer.data.data + block_offset, buf + buffer_offset, copy_amount);
+      fp->buffer_dirty = 1;
+
+      //Write the block once it is filled
+      if (block_offset + copy_amount == BLOCK_SIZE)
+        oufs_flush_buffer(fp);
     }
     else {
-      block_reference = inode.data[block_index];
-    }
+      //Whole blocks: find the blocks for this batch, allocating new ones as needed
+      n_blocks = MIN(OUFS_IO_BATCH, (len - buffer_offset) >> BLOCK_SHIFT);
+      if (fp->buffer_block > block_index && fp->buffer_block < block_index + n_blocks)
+        n_blocks = fp->buffer_block - block_index;
+      for (int b = 0; b < n_blocks; b++)
+        block_buffers[b] = buf + buffer_offset + (b << BLOCK_SHIFT);
+
+      //Sparse: blocks of zeros over holes stay holes.  Skip a run of them,
+      //or end the batch where the next one starts
+      int n_holes = 0;
+      if (fp->sparse) {
+        oufs_bmap(&map, block_index, n_blocks, block_references, 0);
+        for (int b = 0; b < n_blocks; b++) {
+          if (block_references[b] != UNALLOCATED_BLOCK || !oufs_block_is_zero(block_buffers[b], BLOCK_SIZE))
+            continue;
+          if (b == n_holes)
+            n_holes++;
+          else {
+            n_blocks = b;
+            break;
+          }
+        }
+      }
 
-    if (debug) { //Debugging info about variables
-      fprintf(stderr, "##(In loop)Writing to block data[%d] == %d at offset %d, %d bytes.\n##From buffer at offset %d. We have written %d so far.\n", block_index, inode.data[block_index], block_offset, copy_amount, buffer_offset, write_count);
-    }
+      if (n_holes > 0) {
+        copy_amount = n_holes << BLOCK_SHIFT;
+      }
+      else {
+        n_blocks = oufs_bmap(&map, block_index, n_blocks, block_references, 1);
+        if (n_blocks == 0) { //File or file system full, no more data blocks
+          if (debug) {
+            fprintf(stderr, "##No more blocks for inode, ending fwrite\n");
+          }
+          break;
+        }
 
-    //Get block for writing
-    vdisk_read_block(block_reference, &block);
+        if (debug) { //Debugging info about variables
+          fprintf(stderr, "##(In loop)Writing %d blocks from block %d, from buffer at offset %d.\n", n_blocks, block_references[0], buffer_offset);
+        }
 
-    //Write from block_offset to either end of block or end of buf
-    for (int i = block_offset; i < (block_offset + copy_amount); i++) {
-      block.data.data[i] = buf[i + buffer_offset];
+        vdisk_write_blocks(block_references, block_buffers, n_blocks);
+        copy_amount = n_blocks << BLOCK_SHIFT;
+      }
     }
 
-    vdisk_write_block(block_reference, &block);
-
-    //Update write_count, block_offset, buffer_offset, block_index, copy_amount
-    block_index++;
-    block_offset = 0;
+    //Update the offset and the size of the file
     buffer_offset = buffer_offset + copy_amount;
-    write_count = write_count + copy_amount;
-    //Amount that should be copied to the current file block
-    copy_amount = MIN(BLOCK_SIZE, len - buffer_offset);
+    fp->offset = fp->offset + copy_amount;
+    if ((unsigned int) fp->offset > fp->inode.size)
+      fp->inode.size = fp->offset;
+    fp->inode_dirty = 1;
   }
 
   if (debug) { //Debugging info about variables
-    fprintf(stderr, "##(Out of loop)Writing to block data[%d] == %d at offset %d, %d bytes.\n##From buffer at offset %d. We have written %d so far.\n", block_index, inode.data[block_index], block_offset, copy_amount, buffer_offset, write_count);
+    fprintf(stderr, "##(Out of loop)Stopped at offset %d. We have written %d.\n", fp->offset, buffer_offset);
   }
 
-  //Set inode size ot be num bytes written plus size of inode
-  inode.size = inode.size + write_count;
-  oufs_write_inode_by_reference(fp->inode_reference, &inode);
+  //Write back indirect blocks changed by the allocations
+  oufs_bmap_end(&map);
 
   //Return num bytes written
-  return write_count;
+  return buffer_offset;
 }
 
 /**
- * Writes from a buffer to a file
+ * Fill a handle's readahead window with the blocks from block_index on,
+ * with one vectored read, and make the next fill larger
+ *
+ * @param OUFILE *fp File pointer for file of interest
+ * @param map Walk over the file's block map
+ * @param block_index First block of the window
+ * @return 0 if successful, -1 on error
+ */
+static int oufs_readahead(OUFILE *fp, OUFS_BMAP *map, int block_index) {
+  if (fp->ra_window == NULL) {
+    fp->ra_window = malloc((size_t) OUFS_RA_MAX << BLOCK_SHIFT);
+    if (fp->ra_window == NULL)
+      return -1;
+  }
+  fp->ra_count = 0;
+
+  //Never read ahead past the end of the file
+  int n_file_blocks = (fp->inode.size + BLOCK_SIZE - 1) >> BLOCK_SHIFT;
+  int n_blocks = MIN(fp->ra_size, n_file_blocks - block_index);
+  if (n_blocks <= 0)
+    return -1;
+
+  BLOCK_REFERENCE block_references[OUFS_RA_MAX];
+  BLOCK_REFERENCE read_references[OUFS_RA_MAX];
+  void *read_buffers[OUFS_RA_MAX];
+  n_blocks = oufs_bmap(map, block_index, n_blocks, block_references, 0);
+
+  //A block the file does not have reads as zeros
+  int n_read = 0;
+  for (int b = 0; b < n_blocks; b++) {
+    unsigned char *dest = fp->ra_window + (b << BLOCK_SHIFT);
+    if (block_references[b] == UNALLOCATED_BLOCK) {
+      memset(dest, 0, BLOCK_SIZE);
+    }
+    else {
+      read_references[n_read] = block_references[b];
+      read_buffers[n_read] = dest;
+      n_read++;
+    }
+  }
+  if (n_blocks == 0 || vdisk_read_blocks(read_references, read_buffers, n_read) != 0)
+    return -1;
+
+  fp->ra_start = block_index;
+  fp->ra_count = n_blocks;
+  fp->ra_size = MIN(fp->ra_size * 2, OUFS_RA_MAX);
+  return 0;
+}
+
+/**
+ * Reads from a file at its offset into a buffer, and moves the offset past
+ * the bytes read.  Whole blocks are read straight into buf and parts of
+ * blocks come through the handle's block buffer; blocks already in the
+ * readahead window are copied from it
  *
  * @param OUFILE *fp file pointer for file of interest
- * @param unsigned char *buf Buffer containing contents to be written to file
+ * @param unsigned char *buf Buffer to be filled with the contents of the file
  * @param int len size of buf
- * @return int Number of bytes written to file, -1 if error
+ * @param int sequential 1 if the read counts towards the readahead
+ *        heuristic (and may refill the window), 0 for a positional read
+ * @return int Number of bytes read from file, -1 if error
  *
  */
-int oufs_fread(OUFILE *fp, unsigned char * buf, int len) {
-
-  if (debug) {
-    fprintf(stderr, "fread called, fp->offset %d, fp->inode_reference %d.\n", fp->offset, fp->inode_reference);
-  }
+static int oufs_read(OUFILE *fp, unsigned char * buf, int len, int sequential) {
 
   if (fp == NULL) {
     fprintf(stderr, "Invalid file pointer\n");
     return -1;
   }
 
-  if (!(fp->mode == 'r')) {
+  if (debug) {
+    fprintf(stderr, "fread called, fp->offset %d, fp->inode_reference %d.\n", fp->offset, fp->inode_reference);
+  }
+
+  if (!(fp->mode == 'r' || fp->mode == '+')) {
     fprintf(stderr, "Invalid file pointer mode\n");
     return -1;
   }
 
-  INODE inode;
-  oufs_read_inode_by_reference(fp->inode_reference, &inode);
-
   //Set up variables for file read
 
-  //Index of block that we are writing to
-  int block_index = fp->offset / BLOCK_SIZE;
-  //Offset inside of the block that we are writing to
-  int block_offset = fp->offset % BLOCK_SIZE;
-  //Offset inside the buffer we are writing from
+  //Index of block that we are reading from
+  int block_index;
+  //Offset inside of the block that we are reading from
+  int block_offset;
+  //Offset inside the buffer we are reading to
   int buffer_offset = 0;
-  //Amount that has been written so far
-  int read_count = 0;
   //Amount that should be copied from the current file block
-  //Minimized between, block size, remainder of buffer, and remainder of file
-  int read_amount = MIN(BLOCK_SIZE - block_offset, len - buffer_offset);
-  read_amount = MIN(read_amount, inode.size - fp->offset);
+  int read_amount;
 
-  if (debug) {
-    fprintf(stderr, "##Calculating read_amount: min(BLOCK_SIZE - block_offset: %d, len - buffer_offset: %d, inode.size - fp->offset: %d\n)", BLOCK_SIZE - block_offset, len - buffer_offset, inode.size - fp->offset);
+  //Never read past the end of the file
+  if ((unsigned int) fp->offset >= fp->inode.size) {
+    return 0;
   }
+  len = MIN(len, (int) fp->inode.size - fp->offset);
+
+  //Whole blocks are read a batch at a time with one vectored read
+  BLOCK_REFERENCE block_references[OUFS_IO_BATCH];
+  BLOCK_REFERENCE read_references[OUFS_IO_BATCH];
+  void *read_buffers[OUFS_IO_BATCH];
+  int n_blocks;
+  OUFS_BMAP map;
+  oufs_bmap_begin(&map, &fp->inode);
+
+  //Whole blocks are read from the disk, which must have what was written
+  if (oufs_flush_buffer(fp) != 0)
+    return -1;
 
-  BLOCK block;
-  BLOCK_REFERENCE block_reference;
+  //Read ahead while reads follow each other; stop as soon as one doesn't
+  if (!sequential) {
+    //Leave the window and heuristic to the sequential reader
+  }
+  else if (fp->offset != fp->ra_next) {
+    fp->ra_size = 0;
+    fp->ra_count = 0;
+  }
+  else if (fp->ra_size == 0) {
+    fp->ra_size = OUFS_RA_MIN;
+  }
 
   if (debug) { //Debugging info about variables
-    fprintf(stderr, "##(Before loop)Reading from block data[%d] == %d at offset %d, %d bytes.\n##From buffer at offset %d. We have read %d so far.\n", block_index, inode.data[block_index], block_offset, read_amount, buffer_offset, read_count);
+    fprintf(stderr, "##(Before loop)Reading %d bytes at offset %d\n", len, fp->offset);
   }
 
   //Continue while there is still data that should/can be copied
-  while (read_amount > 0) {
+  while (buffer_offset < len) {
+    block_index = fp->offset >> BLOCK_SHIFT;
+    block_offset = fp->offset & BLOCK_MASK;
+    read_amount = MIN(BLOCK_SIZE - block_offset, len - buffer_offset);
+
+    //Refill the readahead window, unless the rest of the read is larger
+    int in_window = block_index >= fp->ra_start && block_index < fp->ra_start + fp->ra_count;
+    if (!in_window && fp->buffer_block != block_index && sequential && fp->ra_size > 0 &&
+        (len - buffer_offset) >> BLOCK_SHIFT < fp->ra_size)
+      in_window = oufs_readahead(fp, &map, block_index) == 0;
+
+    if (in_window) {
+      //Copy from the readahead window up to its end
+      int window_offset = ((block_index - fp->ra_start) << BLOCK_SHIFT) + block_offset;
+      read_amount = MIN((fp->ra_count << BLOCK_SHIFT) - window_offset, len - buffer_offset);
+      memcpy(buf + buffer_offset, fp->ra_window + window_offset, read_amount);
+    }
+    else if (read_amount < BLOCK_SIZE || fp->buffer_block == block_index) {
+      //Part of a block: copy it from the block buffer
+      if (oufs_load_buffer(fp, &map, block_index, 0) != 0)
+        break;
+      memcpy(buf + buffer_offset, fp->buffer.data.data + block_offset, read_amount);
+    }
+    else {
+      //Whole blocks land directly in buf.  A block the file does not have reads as zeros
+      n_blocks = MIN(OUFS_IO_BATCH, (len - buffer_offset) >> BLOCK_SHIFT);
+      n_blocks = oufs_bmap(&map, block_index, n_blocks, block_references, 0);
+      int n_read = 0;
+      for (int b = 0; b < n_blocks; b++) {
+        unsigned char *dest = buf + buffer_offset + (b << BLOCK_SHIFT);
+        if (block_references[b] == UNALLOCATED_BLOCK) {
+          memset(dest, 0, BLOCK_SIZE);
+        }
+        else {
+          read_references[n_read] = block_references[b];
+          read_buffers[n_read] = dest;
+          n_read++;
+        }
+      }
+      if (n_blocks == 0 || vdisk_read_blocks(read_references, read_buffers, n_read) != 0)
+        break;
+      read_amount = n_blocks << BLOCK_SHIFT;
+    }
 
-    block_reference = inode.data[block_index];
+    //Update the offset
+    buffer_offset = buffer_offset + read_amount;
+    fp->offset = fp->offset + read_amount;
+  }
+  oufs_bmap_end(&map);
+  if (sequential)
+    fp->ra_next = fp->offset;
 
-    if (debug) { //Debugging info about variables
-      fprintf(stderr, "##(In loop)Reading from block data[%d] == %d at offset %d, %d bytes.\n##From buffer at offset %d. We have read %d so far.\n", block_index, inode.data[block_index], block_offset, read_amount, buffer_offset, read_count);
+  if (debug) { //Debugging info about variables
+    fprintf(stderr, "##(Out of loop)Stopped at offset %d. We have read %d.\n", fp->offset, buffer_offset);
+  }
+
+  //Return num bytes read
+  return buffer_offset;
+}
+
+/**
+ * Reads from a file at its offset into a buffer, and moves the offset past
+ * the bytes read.  A sequential reader is served from a readahead window
+ * that grows with each fill
+ *
+ * @param OUFILE *fp file pointer for file of interest
+ * @param unsigned char *buf Buffer to be filled with the contents of the file
+ * @param int len size of buf
+ * @return int Number of bytes read from file, -1 if error
+ *
+ */
+int oufs_fread(OUFILE *fp, unsigned char * buf, int len) {
+  return oufs_read(fp, buf, len, 1);
+}
+
+/**
+ * Read from a file at an offset, without moving the file's offset or
+ * disturbing the readahead of a sequential reader
+ *
+ * @param OUFILE *fp File pointer for file of interest
+ * @param unsigned char *buf Buffer to be filled with the contents of the file
+ * @param int len size of buf
+ * @param int offset Where in the file to read
+ * @return int Number of bytes read from file, -1 if error
+ */
+int oufs_pread(OUFILE *fp, unsigned char *buf, int len, int offset) {
+  if (fp == NULL || offset < 0) {
+    fprintf(stderr, "Invalid file pointer or offset\n");
+    return -1;
+  }
+  int saved = fp->offset;
+  fp->offset = offset;
+  int ret = oufs_read(fp, buf, len, 0);
+  fp->offset = saved;
+  return ret;
+}
+
+/**
+ * Write to a file at an offset, without moving the file's offset.  Bytes
+ * already in the file are overwritten in place; the file only grows if the
+ * write ends past its end
+ *
+ * @param OUFILE *fp File pointer for file of interest
+ * @param unsigned char *buf Buffer containing contents to be written to file
+ * @param int len size of buf
+ * @param int offset Where in the file to write
+ * @return int Number of bytes written to file, -1 if error
+ */
+int oufs_pwrite(OUFILE *fp, unsigned char *buf, int len, int offset) {
+  if (fp == NULL || offset < 0) {
+    fprintf(stderr, "Invalid file pointer or offset\n");
+    return -1;
+  }
+  int saved = fp->offset;
+  fp->offset = offset;
+  int ret = oufs_fwrite(fp, buf, len);
+  fp->offset = saved;
+  return ret;
+}
+
+/**
+ * Copy bytes into a set of buffers, as though they were one
+ *
+ * @param iov The buffers
+ * @param iovcnt Number of buffers
+ * @param pos Where in the buffers to start
+ * @param data Bytes to copy, or NULL to copy zeros
+ * @param len Number of bytes
+ */
+static void oufs_iov_scatter(const struct iovec *iov, int iovcnt, long pos, const unsigned char *data, long len) {
+  for (int i = 0; i < iovcnt && len > 0; i++) {
+    if (pos >= (long) iov[i].iov_len) {
+      pos = pos - iov[i].iov_len;
+      continue;
     }
+    long n = MIN((long) iov[i].iov_len - pos, len);
+    if (data == NULL) {
+      memset((unsigned char *) iov[i].iov_base + pos, 0, n);
+    }
+    else {
+      memcpy((unsigned char *) iov[i].iov_base + pos, data, n);
+      data = data + n;
+    }
+    len = len - n;
+    pos = 0;
+  }
+}
 
-    //Get block for reading
-    vdisk_read_block(block_reference, &block);
+/**
+ * Read from a file at an offset into several buffers, in order, without
+ * moving the file's offset or disturbing the readahead of a sequential
+ * reader.  The blocks are mapped in one pass and read with one call to
+ * vdisk_read_blocks(): a block that lies within one buffer lands directly
+ * in it, the others go through a bounce buffer
+ *
+ * @param OUFILE *fp File pointer for file of interest
+ * @param iov The buffers
+ * @param iovcnt Number of buffers
+ * @param int offset Where in the file to read
+ * @return int Number of bytes read from file, -1 if error
+ */
+int oufs_preadv(OUFILE *fp, const struct iovec *iov, int iovcnt, int offset) {
+  if (fp == NULL || offset < 0) {
+    fprintf(stderr, "Invalid file pointer or offset\n");
+    return -1;
+  }
+  if (!(fp->mode == 'r' || fp->mode == '+')) {
+    fprintf(stderr, "Invalid file pointer mode\n");
+    return -1;
+  }
 
-    //Read from block_offset to either end of block or end of buf
-    for (int i = block_offset; i < (block_offset + read_amount); i++) {
-      buf[i + buffer_offset] = block.data.data[i];
+  //Never read past the end of the file
+  long len = 0;
+  for (int i = 0; i < iovcnt; i++)
+    len = len + iov[i].iov_len;
+  if ((unsigned int) offset >= fp->inode.size || len == 0)
+    return 0;
+  len = MIN(len, (long) fp->inode.size - offset);
+
+  //Blocks are read from the disk, which must have what was written
+  if (oufs_flush_buffer(fp) != 0)
+    return -1;
+
+  //Disk blocks of the file's blocks, the blocks to read and where they go,
+  //and room for each block that can't be read straight into a buffer
+  int first = offset >> BLOCK_SHIFT;
+  int n_blocks = ((offset + len - 1) >> BLOCK_SHIFT) - first + 1;
+  BLOCK_REFERENCE *block_references = malloc(2 * n_blocks * sizeof(BLOCK_REFERENCE));
+  void **read_buffers = malloc(n_blocks * sizeof(void *));
+  unsigned char *bounce = malloc((size_t) n_blocks << BLOCK_SHIFT);
+  if (block_references == NULL || read_buffers == NULL || bounce == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    free(block_references);
+    free(read_buffers);
+    free(bounce);
+    return -1;
+  }
+  BLOCK_REFERENCE *read_references = block_references + n_blocks;
+
+  OUFS_BMAP map;
+  oufs_bmap_begin(&map, &fp->inode);
+  int n_mapped = 0;
+  while (n_mapped < n_blocks) {
+    int n = oufs_bmap(&map, first + n_mapped, n_blocks - n_mapped, block_references + n_mapped, 0);
+    if (n <= 0)
+      break;
+    n_mapped = n_mapped + n;
+  }
+  oufs_bmap_end(&map);
+
+  //Where each block goes: buffer i starts at byte iov_start of the read
+  int i = 0;
+  long iov_start = 0;
+  int n_read = 0;
+  for (int b = 0; b < n_mapped; b++) {
+    long start = ((long) (first + b) << BLOCK_SHIFT) - offset;
+    if (block_references[b] == UNALLOCATED_BLOCK)
+      continue;
+    while (i < iovcnt && iov_start + (long) iov[i].iov_len <= start) {
+      iov_start = iov_start + iov[i].iov_len;
+      i++;
     }
+    read_references[n_read] = block_references[b];
+    if (start >= 0 && start + BLOCK_SIZE <= len && i < iovcnt &&
+        start + BLOCK_SIZE <= iov_start + (long) iov[i].iov_len)
+      read_buffers[n_read] = (unsigned char *) iov[i].iov_base + (start - iov_start);
+    else
+      read_buffers[n_read] = bounce + ((size_t) b << BLOCK_SHIFT);
+    n_read++;
+  }
 
-    //Update write_count, block_offset, buffer_offset, block_index, copy_amount
-    block_index++;
-    block_offset = 0;
-    buffer_offset = buffer_offset + read_amount;
-    read_count = read_count + read_amount;
-    //Amount that should be copied from the current file block
-    read_amount = MIN(BLOCK_SIZE, len - buffer_offset);
-    read_amount = MIN(read_amount, inode.size - fp->offset - read_count);
+  int ret = -1;
+  if (n_mapped == n_blocks && vdisk_read_blocks(read_references, read_buffers, n_read) == 0) {
+    //Parts of blocks, and blocks the file does not have (zeros)
+    n_read = 0;
+    for (int b = 0; b < n_blocks; b++) {
+      long start = ((long) (first + b) << BLOCK_SHIFT) - offset;
+      long from = MAX(start, 0);
+      long to = MIN(start + BLOCK_SIZE, len);
+      unsigned char *block = bounce + ((size_t) b << BLOCK_SHIFT);
+      if (block_references[b] == UNALLOCATED_BLOCK)
+        oufs_iov_scatter(iov, iovcnt, from, NULL, to - from);
+      else if (read_buffers[n_read++] == block)
+        oufs_iov_scatter(iov, iovcnt, from, block + (from - start), to - from);
+    }
+    ret = len;
   }
 
-  if (debug) { //Debugging info about variables
-    fprintf(stderr, "##(Out of loop)Reading from block data[%d] == %d at offset %d, %d bytes.\n##From buffer at offset %d. We have read %d so far.\n", block_index, inode.data[block_index], block_offset, read_amount, buffer_offset, read_count);
+  free(block_references);
+  free(read_buffers);
+  free(bounce);
+  return ret;
+}
+
+/**
+ * Write to a file at an offset from several buffers, in order, without
+ * moving the file's offset.  The buffers are gathered into one, so that
+ * the write makes a single pass through the file's blocks
+ *
+ * @param OUFILE *fp File pointer for file of interest
+ * @param iov The buffers
+ * @param iovcnt Number of buffers
+ * @param int offset Where in the file to write
+ * @return int Number of bytes written to file, -1 if error
+ */
+int oufs_pwritev(OUFILE *fp, const struct iovec *iov, int iovcnt, int offset) {
+  if (iovcnt == 1)
+    return oufs_pwrite(fp, iov[0].iov_base, iov[0].iov_len, offset);
+
+  long len = 0;
+  for (int i = 0; i < iovcnt; i++)
+    len = len + iov[i].iov_len;
+  if (len > INT_MAX) {
+    fprintf(stderr, "Write too large\n");
+    return -1;
   }
 
-  //Return num bytes written
-  return read_count;
+  unsigned char *buf = malloc(len > 0 ? len : 1);
+  if (buf == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return -1;
+  }
+  long pos = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    memcpy(buf + pos, iov[i].iov_base, iov[i].iov_len);
+    pos = pos + iov[i].iov_len;
+  }
+  int ret = oufs_pwrite(fp, buf, len, offset);
+  free(buf);
+  return ret;
+}
+
+/**
+ * Move the offset of a file
+ *
+ * @param OUFILE *fp File pointer for file of interest
+ * @param long offset New offset, relative to whence
+ * @param int whence SEEK_SET, SEEK_CUR or SEEK_END
+ * @return int 0 if successful, -1 if the new offset would be negative or
+ *         too large
+ */
+int oufs_fseek(OUFILE *fp, long offset, int whence) {
+  if (fp == NULL) {
+    fprintf(stderr, "Invalid file pointer\n");
+    return -1;
+  }
+
+  long base = 0;
+  if (whence == SEEK_CUR)
+    base = fp->offset;
+  else if (whence == SEEK_END)
+    base = fp->inode.size;
+  else if (whence != SEEK_SET)
+    return -1;
+
+  if (base + offset < 0 || base + offset > INT_MAX)
+    return -1;
+  fp->offset = base + offset;
+  return 0;
+}
+
+/**
+ * Report the offset of a file
+ *
+ * @param OUFILE *fp File pointer for file of interest
+ * @return long The offset, -1 if error
+ */
+long oufs_ftell(OUFILE *fp) {
+  if (fp == NULL) {
+    fprintf(stderr, "Invalid file pointer\n");
+    return -1;
+  }
+  return fp->offset;
+}
+
+/**
+ * Report the readahead window of a file: the blocks that the last fill
+ * read ahead of a sequential reader
+ *
+ * @param OUFILE *fp File pointer for file of interest
+ * @param int *first_block Set to the first file block in the window
+ * @param int *n_blocks Set to the number of blocks (0 if there is none)
+ * @return int 0 if successful, -1 if error
+ */
+int oufs_readahead_window(OUFILE *fp, int *first_block, int *n_blocks) {
+  if (fp == NULL) {
+    fprintf(stderr, "Invalid file pointer\n");
+    return -1;
+  }
+  *first_block = fp->ra_start;
+  *n_blocks = fp->ra_count;
+  return 0;
 }
 
 /**
@@ -538,7 +1018,6 @@ int oufs_remove(char *cwd, char *path) {
   }
 
   INODE inode;
-  BLOCK block;
   oufs_read_inode_by_reference(child, &inode);
 
   if(inode.type != IT_FILE) {
@@ -550,11 +1029,7 @@ int oufs_remove(char *cwd, char *path) {
   //Decrement n_references, and delete inode if n_references is 0
   if (inode.n_references == 0) {
     //Delete Inode, and deallocate data blocks
-    for (int i = 0; i < BLOCKS_PER_INODE; i++) {
-      if (inode.data[i] != UNALLOCATED_BLOCK) {
-        oufs_deallocate_old_block(inode.data[i]);
-      }
-    }
+    oufs_bmap_truncate(&inode, 0);
 
     oufs_clean_inode(&inode);
     oufs_write_inode_by_reference(child, &inode);
@@ -570,23 +1045,7 @@ int oufs_remove(char *cwd, char *path) {
   //Update parent directory (clear entry and inode pointer)
   //and inode (decrement size)
 
-  //Update parent inode
-  oufs_read_inode_by_reference(parent, &inode);
-  inode.size = inode.size - 1;
-  oufs_write_inode_by_reference(parent, &inode);
-
-  //Update parent directory block
-  vdisk_read_block(inode.data[0], &block);
-  //Remove directory entry for removed file
-  int i;
-  for (i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++)
-  {
-    if (strcmp(block.directory.entry[i].name, local_name) == 0) {//If entry is the removed file, overwrite entry, and break from for loop
-      oufs_clean_directory_entry(&(block.directory.entry[i]));
-      vdisk_write_block(inode.data[0], &block);
-      break;
-    }
-  }
+  oufs_directory_remove(parent, local_name);
 
   return 0;
 }
@@ -639,30 +1098,11 @@ int oufs_link(char *cwd, char *path_src, char *path_dst) {
     return -1;
   }
 
-  oufs_read_inode_by_reference(parent_dst, &inode);
-
-  inode.size = inode.size + 1;
-  if (inode.size > DIRECTORY_ENTRIES_PER_BLOCK) {
+  //Update parent_dst inode, and directory
+  if (oufs_directory_add(parent_dst, local_name_dst, child_src) != 0) {
     fprintf(stderr, "Parent directory for src file is full. \n");
     return -1;
   }
-  oufs_write_inode_by_reference(parent_dst, &inode);
-
-  //Update parent_src inode, and directory
-  BLOCK block;
-  vdisk_read_block(inode.data[0], &block);
-
-  //Put in entry in first availible entry space
-  int i;
-  for (i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++)
-  {
-    if (strcmp(block.directory.entry[i].name, "") == 0) {//If entry is empty, write in, and break from for loop
-      strcpy(block.directory.entry[i].name, local_name_dst);
-      block.directory.entry[i].inode_reference = child_src;
-      vdisk_write_block(inode.data[0], &block);
-      break;
-    }
-  }
 
   //Update child inode n_references
   oufs_read_inode_by_reference(child_src, &inode);
@@ -1,48 +1,1191 @@
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <errno.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define VDISK_HAVE_URING 1
+#endif
+// <linux/fs.h> comes along with io_uring.h and has its own BLOCK_SIZE
+#undef BLOCK_SIZE
+#endif
+#endif
+
 #include "vdisk.h"
 /*
  * Virtual disk implementation.
  *
- * The disk is implemented on top of a file.  Access provided by this
- * library is on a block-by-block basis
+ * The disk is implemented on top of a file.  Access provided by this
+ * library is on a block-by-block basis
+ *
+ * The storage itself is reached through a backend (VDISK_BACKEND).  Three
+ * are provided:
+ *   file - pread/pwrite on the disk file
+ *   mmap - the whole disk file is mapped into memory; blocks are copied
+ *          to and from the mapping and msync()ed on flush and close
+ *   ram  - the disk lives in an anonymous buffer.  An existing disk file
+ *          is loaded when opened, but nothing is ever written back
+ *   uring - like file, but multi-block transfers (cache write-back and
+ *          flushes) are queued on an io_uring and waited for once.  Falls
+ *          back to the file path when io_uring is not available
+ * The backend is chosen by vdisk_disk_open_backend(), or by the ZBACKEND
+ * environment variable for vdisk_disk_open() (default: file).
+ *
+ * Backends that ask for it sit under a write-back LRU cache: reads of a
+ * cached block are served from memory and writes only mark the cached
+ * copy dirty.  Dirty blocks reach the backend when they are evicted, on
+ * vdisk_flush() or when the disk is closed.  Evicting a dirty block
+ * writes back a whole batch of the oldest dirty blocks at once, so that
+ * long write sequences leave the cache as a few multi-block transfers.
+ *
+ * The block size and block count are not fixed: they are read from the
+ * superblock in block 0 when the disk is opened (the original 256-byte x
+ * 128-block geometry if there is none), and changed by vdisk_set_geometry()
+ * when a disk is formatted.
+ */
+
+// Debug flag
+#define debug 0
+
+// File descriptor for virtual disk.  Private to this file
+// Yes, global variables are generally a bad idea...
+
+int vdisk_fd = 0;
+
+// Backend of the open disk; NULL when no disk is open
+static const VDISK_BACKEND *vdisk_backend = NULL;
+
+// Name of the open disk, for reopening the backend with a new geometry
+static char *vdisk_name = NULL;
+
+// Geometry of the open disk
+int vdisk_block_size = DEFAULT_BLOCK_SIZE;
+int vdisk_block_shift = 8;
+int vdisk_n_blocks = DEFAULT_N_BLOCKS_IN_DISK;
+
+// In-memory image of the disk for the mmap and ram backends
+static unsigned char *vdisk_image = NULL;
+
+// Called before the disk is flushed or closed, so that layers above can
+// write back state they hold in memory
+static void (*vdisk_flush_hook)(int closing) = NULL;
+
+// Size of the virtual disk in bytes
+#define VDISK_BYTES ((off_t) N_BLOCKS_IN_DISK * BLOCK_SIZE)
+
+/**********************************************************************/
+// File backend
+
+static int file_open(char *virtual_disk_name)
+{
+  // Open file
+  int fd = open(virtual_disk_name, O_RDWR | O_CREAT,
+		S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+  // Check code
+  if(fd <= 0) {
+    fprintf(stderr, "Unable to open virtual disk (%s)\n", virtual_disk_name);
+    return(-1);
+  };
+
+  // Remember the fd in the global variable
+  vdisk_fd = fd;
+  return(0);
+}
+
+static int file_close()
+{
+  close(vdisk_fd);
+  vdisk_fd = 0;
+  return(0);
+}
+
+static int file_read(BLOCK_REFERENCE block_ref, void *block)
+{
+  if(pread(vdisk_fd, block, BLOCK_SIZE, (off_t) block_ref * BLOCK_SIZE) != BLOCK_SIZE) {
+    fprintf(stderr, "vdisk_read_block(): read failed\n");
+    return(-4);
+  }
+  return(0);
+}
+
+static int file_write(BLOCK_REFERENCE block_ref, void *block)
+{
+  if(pwrite(vdisk_fd, block, BLOCK_SIZE, (off_t) block_ref * BLOCK_SIZE) != BLOCK_SIZE) {
+    fprintf(stderr, "vdisk_write_block(): write failed\n");
+    return(-4);
+  }
+  return(0);
+}
+
+static int file_flush()
+{
+  return(0);
+}
+
+static int file_readv(BLOCK_REFERENCE first, int n_blocks, void **blocks)
+{
+  struct iovec iov[n_blocks];
+  for(int i = 0; i < n_blocks; ++i) {
+    iov[i].iov_base = blocks[i];
+    iov[i].iov_len = BLOCK_SIZE;
+  }
+  if(preadv(vdisk_fd, iov, n_blocks, (off_t) first * BLOCK_SIZE) != (ssize_t) n_blocks * BLOCK_SIZE) {
+    fprintf(stderr, "vdisk: readv failed\n");
+    return(-4);
+  }
+  return(0);
+}
+
+static int file_writev(BLOCK_REFERENCE first, int n_blocks, void **blocks)
+{
+  struct iovec iov[n_blocks];
+  for(int i = 0; i < n_blocks; ++i) {
+    iov[i].iov_base = blocks[i];
+    iov[i].iov_len = BLOCK_SIZE;
+  }
+  if(pwritev(vdisk_fd, iov, n_blocks, (off_t) first * BLOCK_SIZE) != (ssize_t) n_blocks * BLOCK_SIZE) {
+    fprintf(stderr, "vdisk: writev failed\n");
+    return(-4);
+  }
+  return(0);
+}
+
+/**********************************************************************/
+// Memory image backends (mmap and ram share everything but open/close/flush)
+
+static int image_read(BLOCK_REFERENCE block_ref, void *block)
+{
+  memcpy(block, vdisk_image + (off_t) block_ref * BLOCK_SIZE, BLOCK_SIZE);
+  return(0);
+}
+
+static int image_write(BLOCK_REFERENCE block_ref, void *block)
+{
+  memcpy(vdisk_image + (off_t) block_ref * BLOCK_SIZE, block, BLOCK_SIZE);
+  return(0);
+}
+
+static int image_readv(BLOCK_REFERENCE first, int n_blocks, void **blocks)
+{
+  for(int i = 0; i < n_blocks; ++i)
+    image_read(first + i, blocks[i]);
+  return(0);
+}
+
+static int image_writev(BLOCK_REFERENCE first, int n_blocks, void **blocks)
+{
+  for(int i = 0; i < n_blocks; ++i)
+    image_write(first + i, blocks[i]);
+  return(0);
+}
+
+static void *image_block_ptr(BLOCK_REFERENCE block_ref)
+{
+  return(vdisk_image + (off_t) block_ref * BLOCK_SIZE);
+}
+
+static int mmap_open(char *virtual_disk_name)
+{
+  if(file_open(virtual_disk_name) != 0)
+    return(-1);
+
+  // Map the whole disk, growing a new or short file to full size first
+  struct stat st;
+  if(fstat(vdisk_fd, &st) != 0 ||
+     (st.st_size < VDISK_BYTES && ftruncate(vdisk_fd, VDISK_BYTES) != 0)) {
+    fprintf(stderr, "Unable to size virtual disk (%s)\n", virtual_disk_name);
+    file_close();
+    return(-1);
+  }
+  void *map = mmap(NULL, VDISK_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, vdisk_fd, 0);
+  if(map == MAP_FAILED) {
+    fprintf(stderr, "Unable to map virtual disk (%s)\n", virtual_disk_name);
+    file_close();
+    return(-1);
+  }
+  vdisk_image = map;
+  return(0);
+}
+
+static int mmap_flush()
+{
+  if(msync(vdisk_image, VDISK_BYTES, MS_SYNC) != 0) {
+    fprintf(stderr, "vdisk_flush(): msync failed\n");
+    return(-1);
+  }
+  return(0);
+}
+
+static int mmap_close()
+{
+  munmap(vdisk_image, VDISK_BYTES);
+  vdisk_image = NULL;
+  return(file_close());
+}
+
+static int ram_open(char *virtual_disk_name)
+{
+  vdisk_image = calloc(1, VDISK_BYTES);
+  if(vdisk_image == NULL) {
+    fprintf(stderr, "Unable to allocate ram disk\n");
+    return(-1);
+  }
+
+  // Start from the contents of the disk file, if there is one.  A short
+  // file (a new disk) leaves the rest of the disk zero
+  int fd = open(virtual_disk_name, O_RDONLY);
+  if(fd > 0) {
+    struct stat st;
+    off_t n_bytes = 0;
+    off_t size = VDISK_BYTES;
+    if(fstat(fd, &st) == 0 && st.st_size < size)
+      size = st.st_size;
+    while(n_bytes < size) {
+      // read() moves at most about 2GB at a time
+      ssize_t n = read(fd, vdisk_image + n_bytes, size - n_bytes);
+      if(n <= 0) {
+        fprintf(stderr, "Unable to load virtual disk (%s)\n", virtual_disk_name);
+        close(fd);
+        free(vdisk_image);
+        vdisk_image = NULL;
+        return(-1);
+      }
+      n_bytes += n;
+    }
+    close(fd);
+  }
+  return(0);
+}
+
+static int ram_flush()
+{
+  return(0);
+}
+
+static int ram_close()
+{
+  free(vdisk_image);
+  vdisk_image = NULL;
+  return(0);
+}
+
+/**********************************************************************/
+// io_uring backend
+//
+// Single-block reads and writes stay synchronous (pread/pwrite): the
+// caller needs the data, or its buffer back, before returning anyway.
+// Batches of runs are queued as READV/WRITEV submissions, handed to the
+// kernel ZURING_BATCH at a time, and reaped once at the end.
+
+// Tunables; 0 means "take from the environment or the default"
+static int uring_depth = 0;
+static int uring_batch = 0;
+
+/**
+ * Set the io_uring queue depth and submission batch size.  Takes effect
+ * the next time a disk is opened with the uring backend.
+ *
+ * @param depth Number of submission queue entries (0: ZURING_DEPTH or
+ *              VDISK_URING_DEFAULT_DEPTH)
+ * @param batch Number of entries queued before they are handed to the
+ *              kernel (0: ZURING_BATCH or VDISK_URING_DEFAULT_BATCH)
+ */
+void vdisk_uring_configure(int depth, int batch)
+{
+  uring_depth = depth < 0 ? 0 : depth;
+  uring_batch = batch < 0 ? 0 : batch;
+}
+
+#ifdef VDISK_HAVE_URING
+
+// State of the ring; fd < 0 when io_uring is unavailable
+static struct {
+  int fd;
+  unsigned depth;
+  unsigned batch;
+
+  // Submission queue
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+
+  // Completion queue
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  // Mappings to release on close
+  void *sq_ptr;
+  size_t sq_size;
+  void *cq_ptr;
+  size_t cq_size;
+  size_t sqes_size;
+} uring = { -1 };
+
+/**
+ * Read a tunable: explicit setting, then the environment, then the default
+ */
+static unsigned uring_tunable(int value, char *env, int def)
+{
+  if(value > 0)
+    return(value);
+  char *str = getenv(env);
+  if(str != NULL && sscanf(str, "%d", &value) == 1 && value > 0)
+    return(value);
+  return(def);
+}
+
+/**
+ * Create the ring
+ *
+ * @return 0 on success; < 0 if io_uring cannot be used
+ */
+static int uring_setup()
+{
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+
+  unsigned depth = uring_tunable(uring_depth, "ZURING_DEPTH", VDISK_URING_DEFAULT_DEPTH);
+  int fd = syscall(__NR_io_uring_setup, depth, &p);
+  if(fd < 0)
+    return(-1);
+
+  uring.sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  uring.cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if((p.features & IORING_FEAT_SINGLE_MMAP) && uring.cq_size > uring.sq_size)
+    uring.sq_size = uring.cq_size;
+  uring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  uring.sq_ptr = mmap(NULL, uring.sq_size, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if(uring.sq_ptr == MAP_FAILED) {
+    close(fd);
+    return(-1);
+  }
+
+  if(p.features & IORING_FEAT_SINGLE_MMAP) {
+    uring.cq_ptr = uring.sq_ptr;
+  }else{
+    uring.cq_ptr = mmap(NULL, uring.cq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if(uring.cq_ptr == MAP_FAILED) {
+      munmap(uring.sq_ptr, uring.sq_size);
+      close(fd);
+      return(-1);
+    }
+  }
+
+  uring.sqes = mmap(NULL, uring.sqes_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if(uring.sqes == MAP_FAILED) {
+    if(uring.cq_ptr != uring.sq_ptr)
+      munmap(uring.cq_ptr, uring.cq_size);
+    munmap(uring.sq_ptr, uring.sq_size);
+    close(fd);
+    return(-1);
+  }
+
+  unsigned char *sq = uring.sq_ptr;
+  unsigned char *cq = uring.cq_ptr;
+  uring.sq_head = (unsigned *) (sq + p.sq_off.head);
+  uring.sq_tail = (unsigned *) (sq + p.sq_off.tail);
+  uring.sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+  uring.sq_array = (unsigned *) (sq + p.sq_off.array);
+  uring.cq_head = (unsigned *) (cq + p.cq_off.head);
+  uring.cq_tail = (unsigned *) (cq + p.cq_off.tail);
+  uring.cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+  uring.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+  uring.depth = p.sq_entries;
+  uring.batch = uring_tunable(uring_batch, "ZURING_BATCH", VDISK_URING_DEFAULT_BATCH);
+  if(uring.batch > uring.depth)
+    uring.batch = uring.depth;
+  uring.fd = fd;
+
+  if(debug)
+    fprintf(stderr, "##io_uring: depth %u, batch %u\n", uring.depth, uring.batch);
+  return(0);
+}
+
+static void uring_teardown()
+{
+  if(uring.fd < 0)
+    return;
+  munmap(uring.sqes, uring.sqes_size);
+  if(uring.cq_ptr != uring.sq_ptr)
+    munmap(uring.cq_ptr, uring.cq_size);
+  munmap(uring.sq_ptr, uring.sq_size);
+  close(uring.fd);
+  uring.fd = -1;
+}
+
+/**
+ * Hand queued submissions to the kernel, optionally waiting for completions
+ *
+ * @return 0 on success; < 0 on error
+ */
+static int uring_enter(unsigned to_submit, unsigned min_complete)
+{
+  unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+  while(to_submit > 0 || min_complete > 0) {
+    int ret = syscall(__NR_io_uring_enter, uring.fd, to_submit, min_complete, flags, NULL, 0);
+    if(ret < 0) {
+      if(errno == EINTR)
+        continue;
+      fprintf(stderr, "vdisk: io_uring_enter failed\n");
+      return(-1);
+    }
+    // A wait only needs to be satisfied once
+    to_submit -= (unsigned) ret < to_submit ? (unsigned) ret : to_submit;
+    min_complete = 0;
+  }
+  return(0);
+}
+
+/**
+ * Reap every completion that is ready
+ *
+ * @param expected Bytes each submission should have transferred, by user_data
+ * @param failed Set to 1 if a submission came up short
+ * @return Number of completions reaped
+ */
+static unsigned uring_reap(ssize_t *expected, int *failed)
+{
+  unsigned head = *uring.cq_head;
+  unsigned tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+  unsigned n = 0;
+
+  while(head != tail) {
+    struct io_uring_cqe *cqe = &uring.cqes[head & *uring.cq_mask];
+    if(cqe->res != expected[cqe->user_data]) {
+      fprintf(stderr, "vdisk: io_uring transfer failed (%d)\n", cqe->res);
+      *failed = 1;
+    }
+    ++head;
+    ++n;
+  }
+  __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+  return(n);
+}
+
+static int uring_open(char *virtual_disk_name)
+{
+  if(file_open(virtual_disk_name) != 0)
+    return(-1);
+  if(uring_setup() != 0 && debug)
+    fprintf(stderr, "##io_uring unavailable: using synchronous I/O\n");
+  return(0);
+}
+
+static int uring_close()
+{
+  uring_teardown();
+  return(file_close());
+}
+
+/**
+ * Transfer runs of at most VDISK_MAX_RUN_BLOCKS blocks in all through the
+ * ring and wait for all of them
+ */
+static int uring_submit_batch(VDISK_RUN *runs, int n_runs, int write)
+{
+  // The iovecs must outlive the submissions, so build them all up front
+  struct iovec iov[VDISK_MAX_RUN_BLOCKS];
+  ssize_t expected[VDISK_MAX_RUN_BLOCKS];
+
+  int failed = 0;
+  unsigned queued = 0;
+  unsigned inflight = 0;
+  struct iovec *next_iov = iov;
+
+  for(int i = 0; i < n_runs; ++i) {
+    // Wait for room in the ring
+    while(inflight == uring.depth) {
+      if(uring_enter(queued, 1) != 0)
+        return(-1);
+      queued = 0;
+      inflight -= uring_reap(expected, &failed);
+    }
+
+    for(int j = 0; j < runs[i].n_blocks; ++j) {
+      next_iov[j].iov_base = runs[i].blocks[j];
+      next_iov[j].iov_len = BLOCK_SIZE;
+    }
+    expected[i] = (ssize_t) runs[i].n_blocks * BLOCK_SIZE;
+
+    unsigned tail = *uring.sq_tail;
+    unsigned index = tail & *uring.sq_mask;
+    struct io_uring_sqe *sqe = &uring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = vdisk_fd;
+    sqe->off = (off_t) runs[i].first * BLOCK_SIZE;
+    sqe->addr = (unsigned long) next_iov;
+    sqe->len = runs[i].n_blocks;
+    sqe->user_data = i;
+    uring.sq_array[index] = index;
+    __atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    next_iov += runs[i].n_blocks;
+    ++queued;
+    ++inflight;
+
+    // Hand over a full batch without waiting
+    if(queued == uring.batch) {
+      if(uring_enter(queued, 0) != 0)
+        return(-1);
+      queued = 0;
+    }
+  }
+
+  // Submit the remainder and wait for everything
+  while(inflight > 0) {
+    if(uring_enter(queued, 1) != 0)
+      return(-1);
+    queued = 0;
+    inflight -= uring_reap(expected, &failed);
+  }
+
+  return(failed ? -4 : 0);
+}
+
+/**
+ * Transfer a batch of runs through the ring and wait for all of them,
+ * VDISK_MAX_RUN_BLOCKS blocks at a time
+ */
+static int uring_submit(VDISK_RUN *runs, int n_runs, int write)
+{
+  // Synchronous fallback
+  if(uring.fd < 0) {
+    int ret = 0;
+    for(int i = 0; i < n_runs; ++i) {
+      if((write ? file_writev : file_readv)(runs[i].first, runs[i].n_blocks, runs[i].blocks) != 0)
+        ret = -1;
+    }
+    return(ret);
+  }
+
+  // Each run holds at most VDISK_MAX_RUN_BLOCKS blocks
+  int first = 0;
+  while(first < n_runs) {
+    int n = 0;
+    int n_blocks = 0;
+    while(first + n < n_runs && n_blocks + runs[first + n].n_blocks <= VDISK_MAX_RUN_BLOCKS) {
+      n_blocks += runs[first + n].n_blocks;
+      ++n;
+    }
+    int ret = uring_submit_batch(runs + first, n, write);
+    if(ret != 0)
+      return(ret);
+    first += n;
+  }
+  return(0);
+}
+
+#else
+
+// No io_uring at compile time: the uring backend is the file backend
+static int uring_open(char *virtual_disk_name)
+{
+  if(debug)
+    fprintf(stderr, "##io_uring not supported: using synchronous I/O\n");
+  return(file_open(virtual_disk_name));
+}
+
+static int uring_close()
+{
+  return(file_close());
+}
+
+#define uring_submit NULL
+
+#endif
+
+/**********************************************************************/
+// Backend table
+
+static const VDISK_BACKEND vdisk_backends[] = {
+  { "file", file_open, file_close, file_read, file_write, file_flush,
+    file_readv, file_writev, NULL, NULL, 1 },
+  { "mmap", mmap_open, mmap_close, image_read, image_write, mmap_flush,
+    image_readv, image_writev, NULL, image_block_ptr, 0 },
+  { "ram", ram_open, ram_close, image_read, image_write, ram_flush,
+    image_readv, image_writev, NULL, image_block_ptr, 0 },
+  { "uring", uring_open, uring_close, file_read, file_write, file_flush,
+    file_readv, file_writev, uring_submit, NULL, 1 },
+};
+
+/**
+ * Transfer a batch of runs, using the backend's batched path if it has one
+ *
+ * @param runs Runs of consecutive blocks
+ * @param n_runs Number of runs
+ * @param write 1 to write the runs, 0 to read them
+ * @return 0 on success; < 0 on error
+ */
+static int vdisk_submit_runs(VDISK_RUN *runs, int n_runs, int write)
+{
+  if(vdisk_backend->submit != NULL)
+    return(vdisk_backend->submit(runs, n_runs, write));
+
+  int ret = 0;
+  for(int i = 0; i < n_runs; ++i) {
+    if((write ? vdisk_backend->writev : vdisk_backend->readv)
+       (runs[i].first, runs[i].n_blocks, runs[i].blocks) != 0)
+      ret = -1;
+  }
+  return(ret);
+}
+
+#define N_VDISK_BACKENDS (sizeof(vdisk_backends) / sizeof(VDISK_BACKEND))
+
+/**
+ * Split a list of blocks into runs of consecutive block references (in
+ * the order given)
+ *
+ * @param block_refs Blocks of interest
+ * @param blocks Buffer for each block
+ * @param n_blocks Number of blocks
+ * @param runs Filled in with the runs (room for n_blocks runs)
+ * @return Number of runs
+ */
+static int vdisk_make_runs(BLOCK_REFERENCE *block_refs, void **blocks, int n_blocks, VDISK_RUN *runs)
+{
+  int n_runs = 0;
+  for(int i = 0; i < n_blocks; ++i) {
+    if(n_runs > 0 && runs[n_runs - 1].n_blocks < VDISK_MAX_RUN_BLOCKS &&
+       block_refs[i] == runs[n_runs - 1].first + runs[n_runs - 1].n_blocks) {
+      ++runs[n_runs - 1].n_blocks;
+    }else{
+      runs[n_runs].first = block_refs[i];
+      runs[n_runs].n_blocks = 1;
+      runs[n_runs].blocks = &blocks[i];
+      ++n_runs;
+    }
+  }
+  return(n_runs);
+}
+
+/**
+ * Look up one of the built-in backends
+ *
+ * @param name Backend name ("file", "mmap", "ram" or "uring")
+ * @return The backend, or NULL if there is no backend with that name
+ */
+const VDISK_BACKEND *vdisk_find_backend(char *name)
+{
+  for(int i = 0; i < N_VDISK_BACKENDS; ++i) {
+    if(strcmp(vdisk_backends[i].name, name) == 0)
+      return(&vdisk_backends[i]);
+  }
+  return(NULL);
+}
+
+/**********************************************************************/
+// Block cache
+
+// One cached disk block
+typedef struct vdisk_cache_entry_s
+{
+  // Block held by this entry
+  BLOCK_REFERENCE block_ref;
+
+  // 1 if the cached copy is newer than the copy on disk
+  int dirty;
+
+  // Chain of entries that hash to the same bucket
+  struct vdisk_cache_entry_s *hash_next;
+
+  // LRU list: head is most recently used, tail is the next victim
+  struct vdisk_cache_entry_s *lru_prev;
+  struct vdisk_cache_entry_s *lru_next;
+
+  // BLOCK_SIZE bytes of cache_data
+  unsigned char *data;
+} VDISK_CACHE_ENTRY;
+
+// Requested cache capacity in blocks (0 disables the cache)
+static int cache_capacity = -1;
+
+// All entries and their block buffers, allocated together when the disk
+// is opened
+static VDISK_CACHE_ENTRY *cache_entries = NULL;
+static unsigned char *cache_data = NULL;
+
+// Entries that do not currently hold a block
+static VDISK_CACHE_ENTRY *cache_free = NULL;
+
+// Room to gather every dirty entry when the whole cache is flushed
+static VDISK_CACHE_ENTRY **cache_dirty = NULL;
+
+// Hash buckets, indexed by block_ref & cache_hash_mask
+static VDISK_CACHE_ENTRY **cache_hash = NULL;
+static unsigned int cache_hash_mask = 0;
+
+// LRU list ends
+static VDISK_CACHE_ENTRY *cache_lru_head = NULL;
+static VDISK_CACHE_ENTRY *cache_lru_tail = NULL;
+
+/**
+ * Unlink an entry from the LRU list
+ */
+static void cache_lru_remove(VDISK_CACHE_ENTRY *entry)
+{
+  if(entry->lru_prev != NULL)
+    entry->lru_prev->lru_next = entry->lru_next;
+  else
+    cache_lru_head = entry->lru_next;
+
+  if(entry->lru_next != NULL)
+    entry->lru_next->lru_prev = entry->lru_prev;
+  else
+    cache_lru_tail = entry->lru_prev;
+
+  entry->lru_prev = entry->lru_next = NULL;
+}
+
+/**
+ * Make an entry the most recently used one
+ */
+static void cache_lru_push(VDISK_CACHE_ENTRY *entry)
+{
+  entry->lru_prev = NULL;
+  entry->lru_next = cache_lru_head;
+  if(cache_lru_head != NULL)
+    cache_lru_head->lru_prev = entry;
+  cache_lru_head = entry;
+  if(cache_lru_tail == NULL)
+    cache_lru_tail = entry;
+}
+
+/**
+ * Find the cache entry holding a block
+ *
+ * @param block_ref Block of interest
+ * @return The entry, or NULL if the block is not cached
+ */
+static VDISK_CACHE_ENTRY *cache_lookup(BLOCK_REFERENCE block_ref)
+{
+  VDISK_CACHE_ENTRY *entry = cache_hash[block_ref & cache_hash_mask];
+  while(entry != NULL && entry->block_ref != block_ref)
+    entry = entry->hash_next;
+  return(entry);
+}
+
+/**
+ * Remove an entry from its hash chain
+ */
+static void cache_hash_remove(VDISK_CACHE_ENTRY *entry)
+{
+  VDISK_CACHE_ENTRY **link = &cache_hash[entry->block_ref & cache_hash_mask];
+  while(*link != entry)
+    link = &(*link)->hash_next;
+  *link = entry->hash_next;
+  entry->hash_next = NULL;
+}
+
+/**
+ * Compare two cache entries by block reference (qsort helper)
+ */
+static int cache_entry_cmp(const void *a, const void *b)
+{
+  BLOCK_REFERENCE ra = (*(VDISK_CACHE_ENTRY **) a)->block_ref;
+  BLOCK_REFERENCE rb = (*(VDISK_CACHE_ENTRY **) b)->block_ref;
+  return((ra > rb) - (ra < rb));
+}
+
+/**
+ * Write a set of dirty entries to the backend as batches of runs of
+ * consecutive blocks (VDISK_MAX_RUN_BLOCKS blocks per batch), and mark
+ * them clean
+ *
+ * @param dirty The entries; reordered by block reference
+ * @param n_dirty Number of entries
+ * @return 0 on success; < 0 on error
  */
+static int cache_write_entries(VDISK_CACHE_ENTRY **dirty, int n_dirty)
+{
+  if(n_dirty == 0)
+    return(0);
 
-// Debug flag
-#define debug 0
+  qsort(dirty, n_dirty, sizeof(VDISK_CACHE_ENTRY *), cache_entry_cmp);
 
-// File descriptor for virtual disk.  Private to this file
-// Yes, global variables are generally a bad idea...
+  BLOCK_REFERENCE block_refs[VDISK_MAX_RUN_BLOCKS];
+  void *blocks[VDISK_MAX_RUN_BLOCKS];
+  VDISK_RUN runs[VDISK_MAX_RUN_BLOCKS];
+  for(int first = 0; first < n_dirty; first += VDISK_MAX_RUN_BLOCKS) {
+    int n = (n_dirty - first < VDISK_MAX_RUN_BLOCKS) ? n_dirty - first : VDISK_MAX_RUN_BLOCKS;
+    for(int i = 0; i < n; ++i) {
+      block_refs[i] = dirty[first + i]->block_ref;
+      blocks[i] = dirty[first + i]->data;
+    }
+    int n_runs = vdisk_make_runs(block_refs, blocks, n, runs);
 
-int vdisk_fd = 0;
+    if(debug)
+      fprintf(stderr, "##Writing back %d blocks in %d runs\n", n, n_runs);
+
+    if(vdisk_submit_runs(runs, n_runs, 1) != 0)
+      return(-1);
+
+    for(int i = 0; i < n; ++i)
+      dirty[first + i]->dirty = 0;
+  }
+  return(0);
+}
+
+/**
+ * Get an unused entry, evicting the least recently used block if needed
+ *
+ * @return A detached entry, or NULL if a dirty victim could not be written
+ */
+static VDISK_CACHE_ENTRY *cache_get_free_entry()
+{
+  VDISK_CACHE_ENTRY *entry = cache_free;
+  if(entry != NULL) {
+    cache_free = entry->lru_next;
+    entry->lru_next = NULL;
+    return(entry);
+  }
+
+  // Evict the tail of the LRU list.  If it is dirty, write it back along
+  // with the next oldest dirty blocks: they are the next victims anyway.
+  entry = cache_lru_tail;
+  if(entry->dirty) {
+    VDISK_CACHE_ENTRY *dirty[VDISK_WRITEBACK_BATCH];
+    int n_dirty = 0;
+    for(VDISK_CACHE_ENTRY *e = entry; e != NULL && n_dirty < VDISK_WRITEBACK_BATCH; e = e->lru_prev) {
+      if(e->dirty)
+        dirty[n_dirty++] = e;
+    }
+    if(cache_write_entries(dirty, n_dirty) != 0)
+      return(NULL);
+  }
+  cache_lru_remove(entry);
+  cache_hash_remove(entry);
+  return(entry);
+}
+
+/**
+ * Put a detached entry into the cache as the most recently used block
+ */
+static void cache_insert(VDISK_CACHE_ENTRY *entry, BLOCK_REFERENCE block_ref, int dirty)
+{
+  unsigned int bucket = block_ref & cache_hash_mask;
+  entry->block_ref = block_ref;
+  entry->dirty = dirty;
+  entry->hash_next = cache_hash[bucket];
+  cache_hash[bucket] = entry;
+  cache_lru_push(entry);
+}
+
+/**
+ * Allocate the cache.  The size comes from vdisk_set_cache_size(), then the
+ * ZCACHE environment variable, then VDISK_CACHE_DEFAULT_BLOCKS.
+ *
+ * @return 0 on success; < 0 on error
+ */
+static int cache_init()
+{
+  if(cache_capacity < 0) {
+    char *str = getenv("ZCACHE");
+    cache_capacity = VDISK_CACHE_DEFAULT_BLOCKS;
+    if(str != NULL && sscanf(str, "%d", &cache_capacity) != 1)
+      cache_capacity = VDISK_CACHE_DEFAULT_BLOCKS;
+    if(cache_capacity < 0)
+      cache_capacity = 0;
+  }
+
+  if(cache_capacity == 0)
+    return(0);
+
+  // Keep chains short: at least two buckets per entry
+  unsigned int buckets = 1;
+  while(buckets < 2 * (unsigned int) cache_capacity)
+    buckets <<= 1;
+
+  cache_entries = calloc(cache_capacity, sizeof(VDISK_CACHE_ENTRY));
+  cache_data = malloc((size_t) cache_capacity * BLOCK_SIZE);
+  cache_hash = calloc(buckets, sizeof(VDISK_CACHE_ENTRY *));
+  cache_dirty = malloc(cache_capacity * sizeof(VDISK_CACHE_ENTRY *));
+  if(cache_entries == NULL || cache_data == NULL || cache_hash == NULL || cache_dirty == NULL) {
+    fprintf(stderr, "vdisk: unable to allocate block cache\n");
+    free(cache_entries);
+    free(cache_data);
+    free(cache_hash);
+    free(cache_dirty);
+    cache_entries = NULL;
+    cache_data = NULL;
+    cache_hash = NULL;
+    cache_dirty = NULL;
+    return(-1);
+  }
+  cache_hash_mask = buckets - 1;
+
+  // Thread every entry onto the free list
+  for(int i = 0; i < cache_capacity; ++i) {
+    cache_entries[i].data = cache_data + ((size_t) i << BLOCK_SHIFT);
+    cache_entries[i].lru_next = (i + 1 < cache_capacity) ? &cache_entries[i + 1] : NULL;
+  }
+  cache_free = cache_entries;
+  cache_lru_head = cache_lru_tail = NULL;
+
+  if(debug)
+    fprintf(stderr, "##Block cache: %d blocks, %u buckets\n", cache_capacity, buckets);
+
+  return(0);
+}
+
+/**
+ * Release the cache.  Dirty blocks must already have been flushed.
+ */
+static void cache_destroy()
+{
+  free(cache_entries);
+  free(cache_data);
+  free(cache_hash);
+  free(cache_dirty);
+  cache_entries = NULL;
+  cache_data = NULL;
+  cache_hash = NULL;
+  cache_dirty = NULL;
+  cache_free = NULL;
+  cache_lru_head = cache_lru_tail = NULL;
+}
+
+/**
+ * Write every dirty cached block to the backend as a single batch
+ *
+ * @return 0 on success; < 0 on error
+ */
+static int cache_flush()
+{
+  if(cache_entries == NULL)
+    return(0);
+
+  // Gather the dirty entries
+  int n_dirty = 0;
+  for(VDISK_CACHE_ENTRY *entry = cache_lru_head; entry != NULL; entry = entry->lru_next) {
+    if(entry->dirty)
+      cache_dirty[n_dirty++] = entry;
+  }
+
+  return(cache_write_entries(cache_dirty, n_dirty));
+}
+
+/**
+ * Set the number of blocks held by the block cache.  Takes effect
+ * immediately if a disk is open (dirty blocks are flushed first).
+ *
+ * @param n_blocks Cache capacity in blocks; 0 disables caching
+ * @return 0 on success; < 0 on error
+ */
+int vdisk_set_cache_size(int n_blocks)
+{
+  if(n_blocks < 0)
+    n_blocks = 0;
+
+  if(vdisk_backend != NULL) {
+    if(cache_flush() != 0)
+      return(-1);
+    cache_destroy();
+  }
+
+  cache_capacity = n_blocks;
+
+  // Only backends that ask for it get a cache
+  if(vdisk_backend != NULL && vdisk_backend->cached)
+    return(cache_init());
+  return(0);
+}
+
+/**********************************************************************/
+// Geometry
+
+/**
+ * Check a block size
+ *
+ * @param block_size Block size in bytes
+ * @return log2 of the block size; < 0 if it is not a supported size
+ */
+static int vdisk_block_size_shift(int block_size)
+{
+  if(block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE ||
+     (block_size & (block_size - 1)) != 0)
+    return(-1);
+  return(__builtin_ctz(block_size));
+}
+
+/**
+ * Make a geometry the current one
+ *
+ * @return 0 on success; < 0 if the geometry is not supported
+ */
+static int vdisk_use_geometry(int block_size, int n_blocks)
+{
+  int shift = vdisk_block_size_shift(block_size);
+  if(shift < 0) {
+    fprintf(stderr, "vdisk: unsupported block size (%d)\n", block_size);
+    return(-2);
+  }
+  if(n_blocks < 1 || n_blocks > VDISK_MAX_BLOCKS) {
+    fprintf(stderr, "vdisk: unsupported number of blocks (%d)\n", n_blocks);
+    return(-2);
+  }
+  vdisk_block_size = block_size;
+  vdisk_block_shift = shift;
+  vdisk_n_blocks = n_blocks;
+  return(0);
+}
+
+/**
+ * Take the geometry of a disk from its superblock.  A missing or empty
+ * disk file, or one without a superblock, has the default geometry.
+ *
+ * @param virtual_disk_name Name of the file containing the virtual disk
+ * @return 0 on success; < 0 if the superblock is not valid
+ */
+static int vdisk_probe_geometry(char *virtual_disk_name)
+{
+  vdisk_use_geometry(DEFAULT_BLOCK_SIZE, DEFAULT_N_BLOCKS_IN_DISK);
+
+  int fd = open(virtual_disk_name, O_RDONLY);
+  if(fd < 0)
+    return(0);
+
+  SUPERBLOCK superblock;
+  ssize_t n = pread(fd, &superblock, sizeof(superblock), SUPERBLOCK_OFFSET);
+  close(fd);
+  if(n != sizeof(superblock) || superblock.magic != SUPERBLOCK_MAGIC)
+    return(0);
+
+  if(superblock.version != SUPERBLOCK_VERSION || superblock.block_shift >= 16 ||
+     vdisk_use_geometry(1 << superblock.block_shift, superblock.n_blocks) != 0) {
+    fprintf(stderr, "Bad superblock on virtual disk (%s)\n", virtual_disk_name);
+    return(-1);
+  }
+
+  if(debug)
+    fprintf(stderr, "##Geometry: %d blocks of %d bytes\n", vdisk_n_blocks, vdisk_block_size);
+  return(0);
+}
+
+/**
+ * Change the geometry of the open disk.  Used when formatting: the
+ * contents of the disk are not converted, and blocks beyond the old end
+ * of the disk read as garbage (or fail) until they are written.
+ *
+ * Layers above are told through the flush hook (as if the disk were being
+ * closed) so that they drop anything they hold for the old geometry.
+ *
+ * @param block_size Block size in bytes (power of two, MIN_BLOCK_SIZE ...
+ *                   MAX_BLOCK_SIZE)
+ * @param n_blocks Number of blocks on the disk (at most VDISK_MAX_BLOCKS)
+ * @return 0 on success; < 0 on error (the disk is closed if it could not
+ *         be reopened)
+ */
+int vdisk_set_geometry(int block_size, int n_blocks)
+{
+  if(vdisk_backend == NULL) {
+    fprintf(stderr, "vdisk_set_geometry(): disk not initialized\n");
+    exit(-1);
+  };
+
+  if(vdisk_block_size_shift(block_size) < 0 || n_blocks < 1 || n_blocks > VDISK_MAX_BLOCKS)
+    return(vdisk_use_geometry(block_size, n_blocks));
+
+  if(block_size == vdisk_block_size && n_blocks == vdisk_n_blocks)
+    return(0);
+
+  // Write back and release everything sized for the old geometry
+  if(vdisk_flush_hook != NULL)
+    vdisk_flush_hook(1);
+  if(vdisk_flush() != 0)
+    return(-1);
+  cache_destroy();
+  const VDISK_BACKEND *backend = vdisk_backend;
+  backend->close();
+
+  // Reopen with the new one
+  vdisk_use_geometry(block_size, n_blocks);
+  if(backend->open(vdisk_name) != 0 ||
+     (backend->cached && cache_init() != 0)) {
+    vdisk_backend = NULL;
+    free(vdisk_name);
+    vdisk_name = NULL;
+    return(-1);
+  }
+  return(0);
+}
+
+/**********************************************************************/
 
 /**
  * Open the virtual disk
  *
+ * The backend is taken from the ZBACKEND environment variable ("file" if
+ * it is not set).
+ *
  * @param virtual_disk_name Name of the file containing the virtual disk
  * @return 0 on success; < 0 on error
  *
  */
 int vdisk_disk_open(char *virtual_disk_name)
 {
-  if(vdisk_fd != 0) {
+  char *name = getenv("ZBACKEND");
+  if(name == NULL)
+    name = "file";
+
+  const VDISK_BACKEND *backend = vdisk_find_backend(name);
+  if(backend == NULL) {
+    fprintf(stderr, "Unknown vdisk backend (%s)\n", name);
+    return(-1);
+  }
+
+  return(vdisk_disk_open_backend(virtual_disk_name, backend));
+}
+
+/**
+ * Open the virtual disk using a specific backend
+ *
+ * @param virtual_disk_name Name of the file containing the virtual disk
+ * @param backend Backend through which the disk is accessed
+ * @return 0 on success; < 0 on error
+ *
+ */
+int vdisk_disk_open_backend(char *virtual_disk_name, const VDISK_BACKEND *backend)
+{
+  if(vdisk_backend != NULL) {
     fprintf(stderr, "A disk is already opened\n");
     return(-1);
   };
 
   if(debug)
-    fprintf(stderr, "##Opening %s \n", virtual_disk_name);
+    fprintf(stderr, "##Opening %s (%s backend)\n", virtual_disk_name, backend->name);
 
-  // Open file
-  int fd = open(virtual_disk_name, O_RDWR | O_CREAT,
-		S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  // The geometry decides how much the backend maps or allocates
+  if(vdisk_probe_geometry(virtual_disk_name) != 0)
+    return(-1);
 
-  // Check code
-  if(fd <= 0) {
-    fprintf(stderr, "Unable to open virtual disk (%s)\n", virtual_disk_name);
+  if(backend->open(virtual_disk_name) != 0)
     return(-1);
-  };
 
-  // Remember the fd in the global variable
-  vdisk_fd = fd;
+  // Set up the block cache
+  if(backend->cached && cache_init() != 0) {
+    backend->close();
+    return(-1);
+  }
+
+  // Remember the backend and the name in the global variables
+  vdisk_backend = backend;
+  vdisk_name = strdup(virtual_disk_name);
   return(0); //success
 };
 
@@ -54,19 +1197,75 @@ int vdisk_disk_open(char *virtual_disk_name)
 int vdisk_disk_close()
 {
   // Must be initialized to close it
-  if(vdisk_fd == 0) {
+  if(vdisk_backend == NULL) {
     fprintf(stderr, "vdisk_disk_close(): disk not initialized\n");
     exit(-1);
   };
 
   if(debug)
     fprintf(stderr, "##Closing vdisk \n");
-  // Close the file
-  close(vdisk_fd);
+
+  // Let the layers above write back and drop what they hold
+  if(vdisk_flush_hook != NULL)
+    vdisk_flush_hook(1);
+
+  // Write back anything still held in the cache
+  int ret = vdisk_flush();
+  cache_destroy();
+
+  // Close the backend
+  if(vdisk_backend->close() != 0)
+    ret = -1;
 
   // Mark as closed
-  vdisk_fd = 0;
-  return(0);
+  vdisk_backend = NULL;
+  free(vdisk_name);
+  vdisk_name = NULL;
+  return(ret);
+}
+
+/**
+ * Write every dirty cached block to the backend and ask the backend to
+ * make its contents durable
+ *
+ * @return 0 on success; < 0 on error
+ */
+int vdisk_flush()
+{
+  if(vdisk_backend == NULL) {
+    fprintf(stderr, "vdisk_flush(): disk not initialized\n");
+    exit(-1);
+  };
+
+  if(vdisk_flush_hook != NULL)
+    vdisk_flush_hook(0);
+
+  int ret = cache_flush();
+  if(vdisk_backend->flush() != 0)
+    ret = -1;
+  return(ret);
+}
+
+/**
+ * Register a function to be called at the start of every vdisk_flush()
+ * (with closing = 0) and vdisk_disk_close() (with closing = 1).  It may
+ * read and write blocks.  Replaces any previously registered hook.
+ *
+ * @param hook The function, or NULL to remove the hook
+ */
+void vdisk_set_flush_hook(void (*hook)(int closing))
+{
+  vdisk_flush_hook = hook;
+}
+
+/**
+ * Name of the backend of the open disk
+ *
+ * @return The backend name, or NULL if no disk is open
+ */
+const char *vdisk_backend_name()
+{
+  return(vdisk_backend == NULL ? NULL : vdisk_backend->name);
 }
 
 /**
@@ -83,7 +1282,7 @@ int vdisk_read_block(BLOCK_REFERENCE block_ref, void *block)
     fprintf(stderr, "##Reading block %d\n", block_ref);
 
   // Make sure that the disk is initialized
-  if(vdisk_fd == 0) {
+  if(vdisk_backend == NULL) {
     fprintf(stderr, "vdisk_read_block(): disk not initialized\n");
     exit(-1);
   };
@@ -94,17 +1293,33 @@ int vdisk_read_block(BLOCK_REFERENCE block_ref, void *block)
     return(-2);
   }
 
-  // Lsek to the correct point in the file
-  if(lseek(vdisk_fd, block_ref * BLOCK_SIZE, SEEK_SET) < 0) {
-    fprintf(stderr, "vdisk_read_block(): seek failed\n");
-    return(-3);
+  // Uncached
+  if(cache_entries == NULL)
+    return(vdisk_backend->read(block_ref, block));
+
+  // Hit: serve from memory
+  VDISK_CACHE_ENTRY *entry = cache_lookup(block_ref);
+  if(entry != NULL) {
+    cache_lru_remove(entry);
+    cache_lru_push(entry);
+    memcpy(block, entry->data, BLOCK_SIZE);
+    return(0);
   }
 
-  // Read the block
-  if(read(vdisk_fd, block, BLOCK_SIZE) != BLOCK_SIZE) {
-    fprintf(stderr, "vdisk_read_block(): read failed\n");
-    return(-4);
+  // Miss: load the block into a cache entry
+  entry = cache_get_free_entry();
+  if(entry == NULL)
+    return(vdisk_backend->read(block_ref, block));
+
+  int ret = vdisk_backend->read(block_ref, entry->data);
+  if(ret != 0) {
+    // Give the entry back
+    entry->lru_next = cache_free;
+    cache_free = entry;
+    return(ret);
   }
+  cache_insert(entry, block_ref, 0);
+  memcpy(block, entry->data, BLOCK_SIZE);
 
   // Success
   return(0);
@@ -123,7 +1338,7 @@ int vdisk_write_block(BLOCK_REFERENCE block_ref, void *block)
     fprintf(stderr, "##Writing block %d\n", block_ref);
 
   // File open?
-  if(vdisk_fd == 0) {
+  if(vdisk_backend == NULL) {
     fprintf(stderr, "vdisk_write_block(): disk not initialized\n");
     exit(-1);
   };
@@ -134,18 +1349,190 @@ int vdisk_write_block(BLOCK_REFERENCE block_ref, void *block)
     return(-2);
   }
 
-  // Move to the beginning of the block
-  if(lseek(vdisk_fd, block_ref * BLOCK_SIZE, SEEK_SET) < 0) {
-    fprintf(stderr, "vdisk_write_block(): seek failed\n");
-    return(-3);
-  }
+  // Uncached: write through
+  if(cache_entries == NULL)
+    return(vdisk_backend->write(block_ref, block));
 
-  // Write the block
-  if(write(vdisk_fd, block, BLOCK_SIZE) != BLOCK_SIZE) {
-    fprintf(stderr, "vdisk_write_block(): write failed\n");
-    return(-4);
+  // The whole block is replaced, so a miss never needs to read the old copy
+  VDISK_CACHE_ENTRY *entry = cache_lookup(block_ref);
+  if(entry != NULL) {
+    cache_lru_remove(entry);
+    cache_lru_push(entry);
+  }else{
+    entry = cache_get_free_entry();
+    if(entry == NULL)
+      return(vdisk_backend->write(block_ref, block));
+    cache_insert(entry, block_ref, 0);
   }
+  memcpy(entry->data, block, BLOCK_SIZE);
+  entry->dirty = 1;
 
   // Success
   return(0);
 }
+
+/**
+ *  Read several disk blocks
+ *
+ *  Cached blocks are copied from the cache.  The rest are read with one
+ *  vectored transfer per run of adjacent block references, in batches of
+ *  VDISK_MAX_RUN_BLOCKS blocks.  Blocks read this way are not added to
+ *  the cache.
+ *
+ * @param block_refs Indices of the blocks to be loaded
+ * @param blocks blocks[i] receives block block_refs[i]
+ * @param n_blocks Number of blocks
+ * @return 0 on success; <0 on error
+ *
+ */
+int vdisk_read_blocks(BLOCK_REFERENCE *block_refs, void **blocks, int n_blocks)
+{
+  if(debug)
+    fprintf(stderr, "##Reading %d blocks\n", n_blocks);
+
+  // Make sure that the disk is initialized
+  if(vdisk_backend == NULL) {
+    fprintf(stderr, "vdisk_read_blocks(): disk not initialized\n");
+    exit(-1);
+  };
+
+  if(n_blocks <= 0)
+    return(0);
+
+  // Take a long request VDISK_MAX_RUN_BLOCKS blocks at a time
+  if(n_blocks > VDISK_MAX_RUN_BLOCKS) {
+    for(int first = 0; first < n_blocks; first += VDISK_MAX_RUN_BLOCKS) {
+      int n = (n_blocks - first < VDISK_MAX_RUN_BLOCKS) ? n_blocks - first : VDISK_MAX_RUN_BLOCKS;
+      int ret = vdisk_read_blocks(block_refs + first, blocks + first, n);
+      if(ret != 0)
+        return(ret);
+    }
+    return(0);
+  }
+
+  BLOCK_REFERENCE miss_refs[VDISK_MAX_RUN_BLOCKS];
+  void *miss_blocks[VDISK_MAX_RUN_BLOCKS];
+  int n_miss = 0;
+
+  for(int i = 0; i < n_blocks; ++i) {
+    // Make sure that we have a valid block request
+    if(block_refs[i] >= N_BLOCKS_IN_DISK) {
+      fprintf(stderr, "vdisk_read_blocks(): bad block_ref(%d)\n", block_refs[i]);
+      return(-2);
+    }
+
+    VDISK_CACHE_ENTRY *entry = cache_entries == NULL ? NULL : cache_lookup(block_refs[i]);
+    if(entry != NULL) {
+      memcpy(blocks[i], entry->data, BLOCK_SIZE);
+    }else{
+      miss_refs[n_miss] = block_refs[i];
+      miss_blocks[n_miss] = blocks[i];
+      ++n_miss;
+    }
+  }
+
+  if(n_miss == 0)
+    return(0);
+
+  VDISK_RUN runs[VDISK_MAX_RUN_BLOCKS];
+  int n_runs = vdisk_make_runs(miss_refs, miss_blocks, n_miss, runs);
+  return(vdisk_submit_runs(runs, n_runs, 0));
+}
+
+/**
+ *  Write several disk blocks
+ *
+ *  The blocks are written through to the backend with one vectored
+ *  transfer per run of adjacent block references, in batches of
+ *  VDISK_MAX_RUN_BLOCKS blocks.  Cached copies are updated (and are then
+ *  clean).
+ *
+ * @param block_refs Indices of the blocks to be written
+ * @param blocks blocks[i] holds the new contents of block block_refs[i]
+ * @param n_blocks Number of blocks
+ * @return 0 on success; <0 on error
+ *
+ */
+int vdisk_write_blocks(BLOCK_REFERENCE *block_refs, void **blocks, int n_blocks)
+{
+  if(debug)
+    fprintf(stderr, "##Writing %d blocks\n", n_blocks);
+
+  // File open?
+  if(vdisk_backend == NULL) {
+    fprintf(stderr, "vdisk_write_blocks(): disk not initialized\n");
+    exit(-1);
+  };
+
+  if(n_blocks <= 0)
+    return(0);
+
+  for(int i = 0; i < n_blocks; ++i) {
+    // Is it a valid block request?
+    if(block_refs[i] >= N_BLOCKS_IN_DISK) {
+      fprintf(stderr, "vdisk_write_blocks(): bad block_ref(%d)\n", block_refs[i]);
+      return(-2);
+    }
+  }
+
+  // Take a long request VDISK_MAX_RUN_BLOCKS blocks at a time
+  if(n_blocks > VDISK_MAX_RUN_BLOCKS) {
+    for(int first = 0; first < n_blocks; first += VDISK_MAX_RUN_BLOCKS) {
+      int n = (n_blocks - first < VDISK_MAX_RUN_BLOCKS) ? n_blocks - first : VDISK_MAX_RUN_BLOCKS;
+      int ret = vdisk_write_blocks(block_refs + first, blocks + first, n);
+      if(ret != 0)
+        return(ret);
+    }
+    return(0);
+  }
+
+  VDISK_RUN runs[VDISK_MAX_RUN_BLOCKS];
+  int n_runs = vdisk_make_runs(block_refs, blocks, n_blocks, runs);
+  if(vdisk_submit_runs(runs, n_runs, 1) != 0)
+    return(-1);
+
+  // Keep cached copies in step with the disk
+  if(cache_entries != NULL) {
+    for(int i = 0; i < n_blocks; ++i) {
+      VDISK_CACHE_ENTRY *entry = cache_lookup(block_refs[i]);
+      if(entry != NULL) {
+        memcpy(entry->data, blocks[i], BLOCK_SIZE);
+        entry->dirty = 0;
+      }
+    }
+  }
+
+  return(0);
+}
+
+/**
+ *  Get direct access to a block of the virtual disk
+ *
+ *  Only backends that keep the disk in memory (mmap, ram) support this.
+ *  Reads and writes through the returned pointer act on the disk itself.
+ *  The pointer stays valid until the disk is closed.
+ *
+ * @param block_ref Index of the block of interest
+ * @return Pointer to the first byte of the block, or NULL if the backend
+ *         does not support it (use vdisk_read_block/vdisk_write_block)
+ *
+ */
+void *vdisk_get_block_ptr(BLOCK_REFERENCE block_ref)
+{
+  // File open?
+  if(vdisk_backend == NULL) {
+    fprintf(stderr, "vdisk_get_block_ptr(): disk not initialized\n");
+    exit(-1);
+  };
+
+  if(vdisk_backend->block_ptr == NULL)
+    return(NULL);
+
+  // Is it a valid block request?
+  if(block_ref >= N_BLOCKS_IN_DISK) {
+    fprintf(stderr, "vdisk_get_block_ptr(): bad block_ref(%d)\n", block_ref);
+    return(NULL);
+  }
+
+  return(vdisk_backend->block_ptr(block_ref));
+}
@@ -8,17 +8,133 @@
 #include <stdlib.h>
 #include <stdio.h>
 
-typedef unsigned short BLOCK_REFERENCE;
+typedef unsigned int BLOCK_REFERENCE;
 
-// Size of block in bytes
-#define BLOCK_SIZE 256
+// Supported block sizes (powers of two)
+#define MIN_BLOCK_SIZE 256
+#define MAX_BLOCK_SIZE 4096
+
+// Largest number of blocks on a disk
+#define VDISK_MAX_BLOCKS (1 << 30)
+
+// Geometry of disks formatted without a superblock, and the zformat default
+#define DEFAULT_BLOCK_SIZE 256
+#define DEFAULT_N_BLOCKS_IN_DISK 128
+
+// Geometry of the open disk: read from its superblock when it is opened
+extern int vdisk_block_size;
+extern int vdisk_block_shift;
+extern int vdisk_n_blocks;
+
+// Size of block in bytes.  Always a power of two, so offsets can be split
+// with BLOCK_SHIFT and BLOCK_MASK
+#define BLOCK_SIZE vdisk_block_size
+#define BLOCK_SHIFT vdisk_block_shift
+#define BLOCK_MASK (vdisk_block_size - 1)
 
 // Total number of blocks on the virtual disk
-#define N_BLOCKS_IN_DISK 128
+#define N_BLOCKS_IN_DISK vdisk_n_blocks
+
+// Superblock: the geometry of a formatted disk.  It lives at a fixed byte
+// offset in block 0 (space the original master block layout never used),
+// so that it can be found before the block size is known.  A disk without
+// one has the default geometry.
+#define SUPERBLOCK_OFFSET 224
+#define SUPERBLOCK_MAGIC 0x5346554f
+#define SUPERBLOCK_VERSION 1
+
+typedef struct superblock_s
+{
+  // SUPERBLOCK_MAGIC on a disk that has a superblock
+  unsigned int magic;
+  unsigned short version;
+
+  // Block size is 1 << block_shift
+  unsigned short block_shift;
+  unsigned int n_blocks;
+
+  // Number of blocks in the file system's inode table
+  unsigned int n_inode_blocks;
+
+  // Optional format features (SUPERBLOCK_FEATURE_* in oufs.h)
+  unsigned int features;
+
+  // Changes whenever a directory is removed, so that a directory inode
+  // saved outside the disk (ZPWD_INODE) can be checked for staleness
+  unsigned int generation;
+
+  unsigned int reserved[2];
+} SUPERBLOCK;
+
+// Number of blocks held by the write-back block cache (override with the
+// ZCACHE environment variable or vdisk_set_cache_size(); 0 disables it)
+#define VDISK_CACHE_DEFAULT_BLOCKS 64
+
+// Number of dirty blocks written back together when the cache evicts one
+#define VDISK_WRITEBACK_BATCH 16
+
+// Longest run of consecutive blocks moved by one vectored transfer
+#define VDISK_MAX_RUN_BLOCKS 256
+
+// io_uring backend: submission queue entries (ZURING_DEPTH) and entries
+// queued before they are handed to the kernel (ZURING_BATCH)
+#define VDISK_URING_DEFAULT_DEPTH 64
+#define VDISK_URING_DEFAULT_BATCH 16
+
+// A run of consecutive blocks: blocks[i] holds block first + i
+typedef struct vdisk_run_s
+{
+  BLOCK_REFERENCE first;
+  int n_blocks;
+  void **blocks;
+} VDISK_RUN;
+
+// Storage behind the virtual disk.  Block operations are only called with
+// valid block references while the disk is open; all return 0 on success
+// and < 0 on error.
+typedef struct vdisk_backend_s
+{
+  // Name used to select the backend (e.g. through ZBACKEND)
+  char *name;
+
+  int (*open)(char *virtual_disk_name);
+  int (*close)();
+  int (*read)(BLOCK_REFERENCE block_ref, void *block);
+  int (*write)(BLOCK_REFERENCE block_ref, void *block);
+
+  // Make written blocks durable
+  int (*flush)();
+
+  // Transfer n_blocks consecutive blocks starting at first; blocks[i]
+  // holds block first + i
+  int (*readv)(BLOCK_REFERENCE first, int n_blocks, void **blocks);
+  int (*writev)(BLOCK_REFERENCE first, int n_blocks, void **blocks);
+
+  // Transfer a batch of runs (write = 1 to write them) and wait for all of
+  // them.  NULL: the runs are passed to readv/writev one at a time
+  int (*submit)(VDISK_RUN *runs, int n_runs, int write);
+
+  // Direct pointer to a block held in memory, or NULL if not supported
+  void *(*block_ptr)(BLOCK_REFERENCE block_ref);
+
+  // 1 if blocks should be held in the write-back block cache
+  int cached;
+} VDISK_BACKEND;
 
 int vdisk_disk_open(char *virtual_disk_name);
+int vdisk_disk_open_backend(char *virtual_disk_name, const VDISK_BACKEND *backend);
+const VDISK_BACKEND *vdisk_find_backend(char *name);
+const char *vdisk_backend_name();
+void vdisk_uring_configure(int depth, int batch);
+int vdisk_set_geometry(int block_size, int n_blocks);
 int vdisk_disk_close();
 int vdisk_read_block(BLOCK_REFERENCE block_ref, void *block);
 int vdisk_write_block(BLOCK_REFERENCE block_ref, void *block);
+int vdisk_read_blocks(BLOCK_REFERENCE *block_refs, void **blocks, int n_blocks);
+int vdisk_write_blocks(BLOCK_REFERENCE *block_refs, void **blocks, int n_blocks);
+int vdisk_flush();
+void vdisk_set_flush_hook(void (*hook)(int closing));
+int vdisk_set_cache_size(int n_blocks);
+void *vdisk_get_block_ptr(BLOCK_REFERENCE block_ref);
 
 #endif
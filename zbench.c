@@ -0,0 +1,102 @@
+/**
+Time the directory scan kernels on a block of entries held in memory
+
+CS3113
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "oufs_lib.h"
+
+/*
+Usage: zbench [-n n_entries] [-r rounds]
+
+Fills n_entries directory entries (default 256, a 4096-byte block of
+narrow entries; at most 65536) and looks up every name, a missing name and a free entry
+with each kernel the processor supports.  No disk is used.
+*/
+
+#define N_KERNEL_NAMES 2
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv) {
+  int n_entries = MAX_BLOCK_SIZE / sizeof(NARROW_DIRECTORY_ENTRY);
+  int rounds = 2000;
+
+  for(int i = 1; i < argc; i += 2) {
+    int *value = NULL;
+    if(strcmp(argv[i], "-n") == 0)
+      value = &n_entries;
+    else if(strcmp(argv[i], "-r") == 0)
+      value = &rounds;
+
+    if(value == NULL || i + 1 >= argc || sscanf(argv[i + 1], "%d", value) != 1 || *value <= 0 || *value > 65536) {
+      fprintf(stderr, "Usage: zbench [-n n_entries] [-r rounds]\n");
+      return(-1);
+    }
+  }
+
+  // Every entry in use but the last, which is free
+  DIRECTORY_ENTRY *entries = calloc(n_entries, sizeof(DIRECTORY_ENTRY));
+  char (*names)[FILE_NAME_SIZE] = calloc(n_entries, FILE_NAME_SIZE);
+  if(entries == NULL || names == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return(-1);
+  }
+  for(int i = 0; i < n_entries - 1; ++i) {
+    snprintf(names[i], FILE_NAME_SIZE, "file%u", (unsigned short) i);
+    strcpy(entries[i].name, names[i]);
+    entries[i].inode_reference = i + 1;
+  }
+  entries[n_entries - 1].inode_reference = UNALLOCATED_INODE;
+
+  const char *kernels[N_KERNEL_NAMES] = {"scalar", "sse2"};
+  double base = 0;
+  for(int k = 0; k < N_KERNEL_NAMES; ++k) {
+    if(oufs_select_scan_kernel(kernels[k]) != 0) {
+      printf("%-8s not supported\n", kernels[k]);
+      continue;
+    }
+
+    // Check the kernel before timing it
+    for(int i = 0; i < n_entries - 1; ++i) {
+      if(oufs_directory_scan(entries, n_entries, names[i], strlen(names[i])) != i) {
+        fprintf(stderr, "%s: wrong entry for %s\n", kernels[k], names[i]);
+        return(-1);
+      }
+    }
+    if(oufs_directory_scan(entries, n_entries, "missing", 7) != -1 ||
+       oufs_directory_scan(entries, n_entries, NULL, 0) != n_entries - 1) {
+      fprintf(stderr, "%s: wrong result for a missing name or a free entry\n", kernels[k]);
+      return(-1);
+    }
+
+    long sum = 0;
+    double start = now();
+    for(int r = 0; r < rounds; ++r) {
+      for(int i = 0; i < n_entries - 1; ++i)
+        sum += oufs_directory_scan(entries, n_entries, names[i], strlen(names[i]));
+      sum += oufs_directory_scan(entries, n_entries, "missing", 7);
+      sum += oufs_directory_scan(entries, n_entries, NULL, 0);
+    }
+    double elapsed = now() - start;
+
+    double per_lookup = elapsed / ((double) rounds * (n_entries + 1)) * 1e9;
+    if(base == 0)
+      base = per_lookup;
+    printf("%-8s %8.1f ns per lookup  %5.2fx  (%ld)\n", kernels[k], per_lookup, base / per_lookup, sum);
+  }
+
+  free(entries);
+  free(names);
+  return(0);
+}
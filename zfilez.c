@@ -9,24 +9,47 @@ CS3113
 
 #include "oufs_lib.h"
 
+/*
+Usage: zfilez [-l] [-R] [path]
+
+-l shows the type, size, link count and number of data blocks of each entry
+-R lists the directories below as well, a level at a time
+*/
+
 int main(int argc, char** argv) {
   // Fetch the key environment vars
   char cwd[MAX_PATH_LENGTH];
   char disk_name[MAX_PATH_LENGTH];
   oufs_get_environment(cwd, disk_name);
 
+  // Check arguments
+  int flags = 0;
+  char *path = NULL;
+  for(int i = 1; i < argc; ++i) {
+    if(argv[i][0] == '-' && argv[i][1] != '\0') {
+      for(char *c = argv[i] + 1; *c != '\0'; ++c) {
+        if(*c == 'l')
+          flags |= OUFS_LIST_LONG;
+        else if(*c == 'R')
+          flags |= OUFS_LIST_RECURSIVE;
+        else {
+          fprintf(stderr, "Usage: zfilez [-l] [-R] [path]\n");
+          return(-1);
+        }
+      }
+    }else if(path == NULL) {
+      path = argv[i];
+    }else{
+      fprintf(stderr, "Usage: zfilez [-l] [-R] [path]\n");
+      return(-1);
+    }
+  }
+
   // Open the virtual disk
   vdisk_disk_open(disk_name);
 
-  // Check arguments
-  if(argc == 2) {
-    // List info about specified path
-    oufs_list(cwd, argv[1]);
-
-  }else{
-    // No file specified, list files in cwd instead
-    oufs_list(cwd, NULL);
-  }
+  // List info about specified path, or about cwd if there is none
+  oufs_list_flags(cwd, path, flags);
 
   // Clean up
   vdisk_disk_close();
@@ -12,7 +12,53 @@ CS3113
 
 #define debug 1
 
+/*
+Usage: zformat [-b block_size] [-n n_blocks] [-i n_inodes] [-w] [-e] [-x]
+
+Defaults give the original geometry: 128 blocks of 256 bytes, 56 inodes
+-w stores 32-bit block and inode references (always on for more than 65535
+blocks or 65533 inodes)
+-e maps files by extents (runs of consecutive blocks) instead of indirect
+blocks
+-x indexes large directories by a hash of the names
+*/
+
 int main(int argc, char** argv) {
+  int block_size = DEFAULT_BLOCK_SIZE;
+  int n_blocks = DEFAULT_N_BLOCKS_IN_DISK;
+  int n_inodes = 0;
+  unsigned int features = SUPERBLOCK_FEATURE_INDIRECT;
+
+  for(int i = 1; i < argc; i += 2) {
+    if(strcmp(argv[i], "-w") == 0) {
+      features |= SUPERBLOCK_FEATURE_WIDE_REFS;
+      --i;
+      continue;
+    }
+    if(strcmp(argv[i], "-e") == 0) {
+      features = (features & ~SUPERBLOCK_FEATURE_INDIRECT) | SUPERBLOCK_FEATURE_EXTENTS;
+      --i;
+      continue;
+    }
+    if(strcmp(argv[i], "-x") == 0) {
+      features |= SUPERBLOCK_FEATURE_DIR_INDEX;
+      --i;
+      continue;
+    }
+
+    int *value = NULL;
+    if(strcmp(argv[i], "-b") == 0)
+      value = &block_size;
+    else if(strcmp(argv[i], "-n") == 0)
+      value = &n_blocks;
+    else if(strcmp(argv[i], "-i") == 0)
+      value = &n_inodes;
+
+    if(value == NULL || i + 1 >= argc || sscanf(argv[i + 1], "%d", value) != 1) {
+      fprintf(stderr, "Usage: zformat [-b block_size] [-n n_blocks] [-i n_inodes] [-w] [-e] [-x]\n");
+      return(-1);
+    }
+  }
 
 	// Open the virtual disk
 	// Fetch the key environment vars
@@ -22,7 +68,10 @@ int main(int argc, char** argv) {
 
   vdisk_disk_open(disk_name);
 
-	oufs_format_disk(disk_name);
+	if(oufs_format_disk_geometry(disk_name, block_size, n_blocks, n_inodes, features) != 0) {
+	  vdisk_disk_close();
+	  return(-1);
+	}
 
 	// Clean up
 	vdisk_disk_close();
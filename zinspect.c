@@ -7,12 +7,28 @@
 -master
 	Displays information about block allocation table and inode allocation table
 
+-super
+	Displays the disk geometry (block size, block count, inode table)
+
+-cwd
+	Displays the value of ZPWD_INODE for the current ZPWD, so that later
+	commands can start from the working directory without walking to it:
+	export ZPWD_INODE=$(zinspect -cwd)
+
 -inode #
 	Displays information about inode number # including type, block pointers, size
 
 -inodee #
 	Extended inode query
 
+-extents #
+	Displays the runs of consecutive blocks that hold the data of inode #
+	(its extent list on a disk formatted with extents)
+
+-readahead <file>
+	Reads <file> sequentially, with a positional read of its first bytes
+	after every read, and displays each fill of the readahead window
+
 -dblock #
 	Displays information about block number # as though it is a directory
 
@@ -22,6 +38,29 @@
 
 */
 
+/**
+ * A block reference as it is stored on disk: narrow disks keep 16 bits, so
+ * an unallocated block shows as 65535 there
+ */
+static unsigned int disk_block_reference(BLOCK_REFERENCE ref)
+{
+  if(!(oufs_geometry()->features & SUPERBLOCK_FEATURE_WIDE_REFS) && ref == UNALLOCATED_BLOCK)
+    return(NARROW_UNALLOCATED_BLOCK);
+  return(ref);
+}
+
+/**
+ * Print one extent of a file
+ */
+static void print_extent(int k, unsigned int file_block, BLOCK_REFERENCE start, unsigned int length)
+{
+  if(start == UNALLOCATED_BLOCK)
+    printf("Extent %d: file blocks %u-%u, hole\n", k, file_block, file_block + length - 1);
+  else
+    printf("Extent %d: file blocks %u-%u, disk blocks %u-%u\n", k, file_block, file_block + length - 1,
+	   start, start + length - 1);
+}
+
 int main(int argc, char** argv) {
   if(vdisk_disk_open("vdisk1") != 0) {
     return(-1);
@@ -29,20 +68,38 @@ int main(int argc, char** argv) {
 
   if(argc == 2){
     if(strncmp(argv[1], "-master", 8) == 0) {
-      // Master record
-      BLOCK block;
-      if(vdisk_read_block(0, &block) != 0) {
-	fprintf(stderr, "Error reading master block\n");
+      // Master record: allocation tables
+      unsigned char *inode_table = oufs_allocation_table(1);
+      unsigned char *block_table = oufs_allocation_table(0);
+      printf("Inode table:\n");
+      for(int i = 0; i < (N_INODES + 7) / 8; ++i) {
+	printf("%02x\n", inode_table[i]);
+      }
+      printf("Block table:\n");
+      for(int i = 0; i < (N_BLOCKS_IN_DISK + 7) / 8; ++i) {
+	printf("%02x\n", block_table[i]);
+      }
+
+    }else if(strncmp(argv[1], "-super", 7) == 0) {
+      // Geometry
+      const OUFS_GEOMETRY *g = oufs_geometry();
+      printf("Block size: %d\n", BLOCK_SIZE);
+      printf("Blocks: %d\n", N_BLOCKS_IN_DISK);
+      printf("Inodes: %d\n", g->n_inodes);
+      printf("References: %s\n", (g->features & SUPERBLOCK_FEATURE_WIDE_REFS) ? "32-bit" : "16-bit");
+      printf("Inode blocks: %d-%d\n", g->inode_table_block, g->inode_table_block + g->n_inode_blocks - 1);
+      printf("Root directory block: %d\n", ROOT_DIRECTORY_BLOCK);
+
+    }else if(strncmp(argv[1], "-cwd", 5) == 0) {
+      // Saved working directory
+      char cwd[MAX_PATH_LENGTH];
+      char disk_name[MAX_PATH_LENGTH];
+      char cookie[64];
+      oufs_get_environment(cwd, disk_name);
+      if(oufs_cwd_cookie(cwd, cookie, sizeof(cookie)) != 0) {
+	fprintf(stderr, "Can't resolve working directory (%s)\n", cwd);
       }else{
-	// Block read: report state
-	printf("Inode table:\n");
-	for(int i = 0; i < INODES_PER_BLOCK *  N_INODE_BLOCKS / 8; ++i) {
-	  printf("%02x\n", block.master.inode_allocated_flag[i]);
-	}
-	printf("Block table:\n");
-	for(int i = 0; i < N_BLOCKS_IN_DISK / 8; ++i) {
-	  printf("%02x\n", block.master.block_allocated_flag[i]);
-	}
+	printf("%s\n", cookie);
       }
 
     }else{
@@ -63,7 +120,7 @@ int main(int argc, char** argv) {
 	  printf("Inode: %d\n", index);
 	  printf("Type: %c\n", inode.type);
 	  for(int i = 0; i < BLOCKS_PER_INODE; ++i) {
-	    printf("Block %d: %d\n", i, inode.data[i]);
+	    printf("Block %d: %u\n", i, disk_block_reference(inode.data[i]));
 	  }
 	  printf("Size: %d\n", inode.size);
 
@@ -85,7 +142,7 @@ int main(int argc, char** argv) {
 	  printf("Type: %c\n", inode.type);
 	  printf("N references: %d\n", inode.n_references);
 	  for(int i = 0; i < BLOCKS_PER_INODE; ++i) {
-	    printf("Block %d: %d\n", i, inode.data[i]);
+	    printf("Block %d: %u\n", i, disk_block_reference(inode.data[i]));
 	  }
 	  printf("Size: %d\n", inode.size);
 
@@ -93,6 +150,83 @@ int main(int argc, char** argv) {
       }else{
 	fprintf(stderr, "Unknown argument (-inode %s)\n", argv[2]);
       }
+    }else if(strncmp(argv[1], "-extents", 9) == 0) {
+      // Extent query
+      int index;
+      if(sscanf(argv[2], "%d", &index) == 1){
+	if(index < 0 || index >= N_INODES) {
+	  fprintf(stderr, "Inode index out of range (%s)\n", argv[2]);
+	}else{
+	  INODE inode;
+	  oufs_read_inode_by_reference(index, &inode);
+	  OUFS_BMAP map;
+	  oufs_bmap_begin(&map, &inode);
+
+	  printf("Inode: %d\n", index);
+	  const OUFS_EXTENT *extents;
+	  int n_extents = oufs_bmap_extents(&map, &extents);
+	  unsigned int file_block = 0;
+	  if(n_extents >= 0) {
+	    for(int k = 0; k < n_extents; ++k) {
+	      print_extent(k, file_block, extents[k].start, extents[k].length);
+	      file_block += extents[k].length;
+	    }
+	  }else{
+	    // Block-mapped: gather the runs from the block map
+	    int n_file_blocks = (inode.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	    BLOCK_REFERENCE start = UNALLOCATED_BLOCK;
+	    unsigned int length = 0;
+	    n_extents = 0;
+	    for(int i = 0; i < n_file_blocks; ++i) {
+	      BLOCK_REFERENCE ref;
+	      oufs_bmap(&map, i, 1, &ref, 0);
+	      if(length > 0 && (start == UNALLOCATED_BLOCK ? ref == UNALLOCATED_BLOCK : ref == start + length)) {
+		++length;
+		continue;
+	      }
+	      if(length > 0)
+		print_extent(n_extents++, file_block, start, length);
+	      file_block += length;
+	      start = ref;
+	      length = 1;
+	    }
+	    if(length > 0)
+	      print_extent(n_extents++, file_block, start, length);
+	  }
+	  oufs_bmap_end(&map);
+	  printf("Extents: %d\n", n_extents);
+	}
+      }else{
+	fprintf(stderr, "Unknown argument (-extents %s)\n", argv[2]);
+      }
+    }else if(strncmp(argv[1], "-readahead", 11) == 0) {
+      // Sequential reads, each followed by a positional read of the start
+      char cwd[MAX_PATH_LENGTH];
+      char disk_name[MAX_PATH_LENGTH];
+      oufs_get_environment(cwd, disk_name);
+      OUFILE *fp = oufs_fopen(cwd, argv[2], "r");
+      if(fp != NULL) {
+	unsigned char chunk[100];
+	char head[2][9] = {"", ""};
+	struct iovec iov[2] = {{head[0], 8}, {head[1], 8}};
+	int ra_start = -1;
+	int ra_count = 0;
+	while(oufs_fread(fp, chunk, sizeof(chunk)) > 0) {
+	  int start, count;
+	  oufs_readahead_window(fp, &start, &count);
+	  if(start != ra_start || count != ra_count) {
+	    ra_start = start;
+	    ra_count = count;
+	    printf("Offset %ld: window of %d blocks from block %d\n", oufs_ftell(fp), ra_count, ra_start);
+	  }
+	  if(oufs_preadv(fp, iov, 2, 0) != 16) {
+	    fprintf(stderr, "Positional read failed\n");
+	    break;
+	  }
+	}
+	printf("Start: %s%s\n", head[0], head[1]);
+	oufs_fclose(fp);
+      }
     }else if(strncmp(argv[1], "-dblock", 8) == 0) {
       // Inspect directory block
       int index;
@@ -101,7 +235,7 @@ int main(int argc, char** argv) {
 	  fprintf(stderr, "Block index out of range (%s)\n", argv[2]);
 	}else{
 	  BLOCK block;
-	  vdisk_read_block(index, &block);
+	  oufs_read_directory_block(index, &block);
 	  printf("Directory at block %d:\n", index);
 	  for(int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; ++i) {
 	    if(block.directory.entry[i].inode_reference != UNALLOCATED_INODE) {